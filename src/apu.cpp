@@ -177,6 +177,7 @@ static inline u16 SweepTargetPeriod(apu_pulse& Pulse, bool NegateOnesComplement)
 	return Period < 0 ? 0 : u16(Period);
 }
 
+template <i32 MapperID>
 void StepAPU(machine& Machine)
 {
 	apu& APU = Machine.APU;
@@ -291,8 +292,9 @@ void StepAPU(machine& Machine)
 				P.Length -= 1;
 		}
 
-		// Clock the timer at half the CPU clock rate.
-		if (APU.FrameCycle % 2 == 0) {
+		// Clock the timer at half the CPU clock rate.  The waveform sequencer
+		// only affects the audio output, so it is skipped when audio is disabled.
+		if (!Machine.AudioDisable && APU.FrameCycle % 2 == 0) {
 			if (P.Timer == 0) {
 				// Advance the waveform sequencer.
 				P.SequenceTime = (P.SequenceTime + 1) % 8;
@@ -326,16 +328,19 @@ void StepAPU(machine& Machine)
 				T.Length -= 1;
 		}
 
-		// Clock the timer at CPU clock rate.
-		if (T.Timer == 0) {
-			// Advance the sequencer if length and linear counters are both nonzero.
-			if (T.Length > 0 && T.Counter > 0)
-				T.SequenceTime = (T.SequenceTime + 1) % 32;
+		// Clock the timer at CPU clock rate.  The sequencer only affects
+		// the audio output, so it is skipped when audio is disabled.
+		if (!Machine.AudioDisable) {
+			if (T.Timer == 0) {
+				// Advance the sequencer if length and linear counters are both nonzero.
+				if (T.Length > 0 && T.Counter > 0)
+					T.SequenceTime = (T.SequenceTime + 1) % 32;
 
-			T.Timer = T.TimerPeriod;
-		}
-		else {
-			T.Timer -= 1;
+				T.Timer = T.TimerPeriod;
+			}
+			else {
+				T.Timer -= 1;
+			}
 		}
 	}
 
@@ -374,8 +379,9 @@ void StepAPU(machine& Machine)
 				N.Length -= 1;
 		}
 
-		// Clock the timer at half the CPU clock rate.
-		if (APU.FrameCycle % 2 == 0) {
+		// Clock the timer at half the CPU clock rate.  The noise register
+		// only affects the audio output, so it is skipped when audio is disabled.
+		if (!Machine.AudioDisable && APU.FrameCycle % 2 == 0) {
 			if (N.Timer == 0) {
 				u16 R = N.NoiseRegister;
 				u16 S = N.NoiseMode ? (R >> 6) : (R >> 1);
@@ -398,7 +404,7 @@ void StepAPU(machine& Machine)
 		if (D.SampleBufferEmpty && D.SampleTransferCounter > 0) {
 			Machine.CPU.Stall += 4;
 			
-			D.SampleBuffer = Read(Machine, D.SampleTransferPointer);
+			D.SampleBuffer = Read<MapperID>(Machine, D.SampleTransferPointer);
 			D.SampleBufferEmpty = false;
 			D.SampleTransferPointer = (D.SampleTransferPointer + 1) | 0x8000;
 			D.SampleTransferCounter -= 1;
@@ -448,7 +454,13 @@ void StepAPU(machine& Machine)
 		}
 	}
 
-	APU.AudioSampleCount += APU.AudioSampleRate / 1789773.0;
+	// Everything below only generates audio samples.  The DMC output unit
+	// above must keep running even when audio is disabled, because it drives
+	// the sample DMA (and thus CPU stalls and the DMC interrupt).
+	if (Machine.AudioDisable)
+		return;
+
+	APU.AudioSampleCount += Machine.AudioSampleRate / 1789773.0;
 
 	while (APU.AudioSampleCount >= 1.0) {
 		// Channel values.
@@ -498,11 +510,17 @@ void StepAPU(machine& Machine)
 		f64 Alpha = 1.0;
 		APU.AudioSample = Alpha * Output + (1 - Alpha) * APU.AudioSample;
 
-		if (APU.AudioPointer < 8192) {
-			APU.AudioBuffer[APU.AudioPointer] = u8(APU.AudioSample * 255);
-			APU.AudioPointer += 1;
+		if (Machine.AudioPointer < i32(MachineAudioBufferSize)) {
+			Machine.AudioBuffer[Machine.AudioPointer] = u8(APU.AudioSample * 255);
+			Machine.AudioPointer += 1;
 		}
 
 		APU.AudioSampleCount -= 1.0;
 	}
 }
+
+template void StepAPU<0>(machine& Machine);
+template void StepAPU<1>(machine& Machine);
+template void StepAPU<2>(machine& Machine);
+template void StepAPU<3>(machine& Machine);
+template void StepAPU<4>(machine& Machine);
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "nes.h"
+
+// An archive of cells for Go-Explore style exploration.  A cell function
+// maps a machine state to a cell key (e.g. the level and a coarse player
+// position read from RAM), and the archive keeps the best state seen in each
+// cell as a save state, so that exploration can be continued from any cell.
+// Without a cell function, the key is the full 128-bit state hash of the
+// machine (see hash.cpp), so that every distinct state is a cell of its own.
+// Keys from a cell function are 64-bit, and kept with the high half zero.
+//
+// Cells are found through an open addressing hash table holding the keys,
+// so that updating the archive with a known cell does not touch the cells
+// themselves, and only new and improved cells pay for saving the state.
+
+struct archive_slot
+{
+	state_hash      Key;
+	u32             Index;                      // Cell index plus one (0 for an empty slot).
+};
+
+struct archive
+{
+	cell_function   CellFunction;               // Maps a state to a cell key (optional).
+	void*           Context;                    // Context passed to CellFunction.
+	state_hasher*   Hasher;                     // Computes the key without a cell function.
+	u32             StateSize;                  // Size of the save states.
+
+	archive_cell*   Cells;
+	u32             CellCount;
+	u32             CellCapacity;
+
+	archive_slot*   Table;                      // Hash table of the cells.
+	u32             TableSize;                  // Size of the hash table (power of two).
+};
+
+static u32 GetSlot(const archive* Archive, state_hash Key)
+{
+	return u32(((Key.Low ^ Key.High) * 0x9E3779B97F4A7C15) >> 32) & (Archive->TableSize - 1);
+}
+
+static bool IsSameKey(state_hash A, state_hash B)
+{
+	return A.Low == B.Low && A.High == B.High;
+}
+
+// Doubles the size of the hash table, and reinserts the cells.
+static void GrowTable(archive* Archive)
+{
+	free(Archive->Table);
+	Archive->TableSize *= 2;
+	Archive->Table = (archive_slot*)calloc(Archive->TableSize, sizeof(archive_slot));
+
+	u32 Mask = Archive->TableSize - 1;
+	for (u32 I = 0; I < Archive->CellCount; I++) {
+		state_hash Key = Archive->Cells[I].Key;
+		u32 Slot = GetSlot(Archive, Key);
+		while (Archive->Table[Slot].Index) Slot = (Slot + 1) & Mask;
+		Archive->Table[Slot].Key = Key;
+		Archive->Table[Slot].Index = I + 1;
+	}
+}
+
+// Creates an empty archive.  If no cell function is given, the cells are
+// keyed by the state hash of the machine, with the given state hash flags.
+archive* CreateArchive(cell_function CellFunction, void* Context, u32 HashFlags)
+{
+	archive* Archive = (archive*)calloc(1, sizeof(archive));
+	Archive->CellFunction = CellFunction;
+	Archive->Context = Context;
+	if (!CellFunction) Archive->Hasher = CreateStateHasher(HashFlags);
+
+	Archive->TableSize = 1024;
+	Archive->Table = (archive_slot*)calloc(Archive->TableSize, sizeof(archive_slot));
+
+	return Archive;
+}
+
+void DestroyArchive(archive* Archive)
+{
+	if (!Archive) return;
+
+	for (u32 I = 0; I < Archive->CellCount; I++)
+		free(Archive->Cells[I].State);
+
+	free(Archive->Cells);
+	free(Archive->Table);
+	DestroyStateHasher(Archive->Hasher);
+	free(Archive);
+}
+
+// Adds the current state of the machine to its cell, with the score
+// reached and the number of frames it took to get there.  The state
+// is saved if the cell is new, or if the state is better than the one
+// kept for the cell.
+archive_result UpdateArchive(archive* Archive, machine& Machine, f64 Score, u32 FrameCount)
+{
+	state_hash Key = {};
+	if (Archive->CellFunction)
+		Key.Low = Archive->CellFunction(Machine, Archive->Context);
+	else
+		Key = UpdateStateHash(Archive->Hasher, Machine);
+
+	u32 Mask = Archive->TableSize - 1;
+	u32 Slot = GetSlot(Archive, Key);
+	for (; Archive->Table[Slot].Index; Slot = (Slot + 1) & Mask) {
+		if (!IsSameKey(Archive->Table[Slot].Key, Key)) continue;
+
+		archive_cell& Cell = Archive->Cells[Archive->Table[Slot].Index - 1];
+		Cell.VisitCount += 1;
+
+		if (Score < Cell.Score || (Score == Cell.Score && FrameCount >= Cell.FrameCount))
+			return ArchiveVisited;
+
+		Cell.Score = Score;
+		Cell.FrameCount = FrameCount;
+		Cell.RestoreCount = 0;
+		SaveState(Machine, Cell.State, Archive->StateSize);
+		return ArchiveImproved;
+	}
+
+	if (Archive->CellCount == Archive->CellCapacity) {
+		Archive->CellCapacity = Archive->CellCapacity ? 2 * Archive->CellCapacity : 1024;
+		Archive->Cells = (archive_cell*)realloc(Archive->Cells, Archive->CellCapacity * sizeof(archive_cell));
+	}
+
+	if (!Archive->StateSize) Archive->StateSize = GetStateSize(Machine);
+
+	archive_cell& Cell = Archive->Cells[Archive->CellCount];
+	Cell.Key = Key;
+	Cell.Score = Score;
+	Cell.FrameCount = FrameCount;
+	Cell.VisitCount = 1;
+	Cell.RestoreCount = 0;
+	Cell.State = malloc(Archive->StateSize);
+	SaveState(Machine, Cell.State, Archive->StateSize);
+
+	Archive->CellCount += 1;
+	Archive->Table[Slot].Key = Key;
+	Archive->Table[Slot].Index = Archive->CellCount;
+
+	// Keep the hash table at most half full.
+	if (2 * Archive->CellCount > Archive->TableSize) GrowTable(Archive);
+
+	return ArchiveAdded;
+}
+
+// Returns the index of the cell with the given key, or -1 if not found.
+i32 FindArchiveCell(const archive* Archive, state_hash Key)
+{
+	u32 Mask = Archive->TableSize - 1;
+	for (u32 Slot = GetSlot(Archive, Key); Archive->Table[Slot].Index; Slot = (Slot + 1) & Mask) {
+		if (IsSameKey(Archive->Table[Slot].Key, Key))
+			return i32(Archive->Table[Slot].Index - 1);
+	}
+	return -1;
+}
+
+// Finds a cell by the key returned by the cell function.
+i32 FindArchiveCell(const archive* Archive, u64 Key)
+{
+	return FindArchiveCell(Archive, state_hash{ Key, 0 });
+}
+
+u32 GetArchiveSize(const archive* Archive)
+{
+	return Archive->CellCount;
+}
+
+// Cells are numbered in the order they were added.  The returned pointer
+// is valid until the archive is next updated.
+const archive_cell* GetArchiveCell(const archive* Archive, u32 Index)
+{
+	return &Archive->Cells[Index];
+}
+
+// Loads the state kept for a cell into the machine.
+// Returns 0 on success, or -1 on failure.
+i32 RestoreArchiveCell(archive* Archive, u32 Index, machine& Machine)
+{
+	if (Index >= Archive->CellCount) return -1;
+
+	archive_cell& Cell = Archive->Cells[Index];
+	if (LoadState(Machine, Cell.State, Archive->StateSize) < 0) return -1;
+
+	Cell.RestoreCount += 1;
+	return 0;
+}
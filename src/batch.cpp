@@ -0,0 +1,360 @@
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "nes.h"
+
+// A batch owns a number of machines and runs them on a pool of threads.
+// The machines are split into groups (of one machine each, unless running
+// in lockstep mode, see below).  Each thread is assigned a contiguous range
+// of groups, and claims them one at a time.  A thread that has finished its own range steals from the
+// ranges of the others, so the threads finish at about the same time even
+// if some machines are slower to emulate than others.
+//
+// The calling thread works as thread 0 while a batch is running.
+//
+// In lockstep mode, machines whose states are identical at the start of a
+// run (same emulation state and same input) are grouped together.  Only the
+// first machine of each group is emulated, and its resulting state is then
+// copied to the others.  Machines diverge into separate groups as soon as
+// their input or state differs.  Only machines with the same host settings
+// (video, audio and index output) are grouped, and machines with an input
+// callback, a movie or tracing are always run on their own.
+//
+// Machines can be given a RAM search, which then gets a snapshot of the
+// machine after every frame, e.g. to label the addresses of game variables
+// over many runs at once.
+
+struct alignas(64) batch_worker
+{
+	std::thread         Thread;
+	std::atomic<u32>    Next;                   // Next group to claim in the range.
+	u32                 End;                    // End of the range.
+	batch_thread_stats  Stats;
+};
+
+struct batch
+{
+	machine*                Machines;
+	u32                     MachineCount;
+	batch_worker*           Workers;
+	u32                     WorkerCount;
+
+	bool                    Lockstep;           // Run identical machines only once.
+	u32                     GroupCount;         // Number of groups of identical machines.
+	u32*                    GroupStart;         // Start of each group in GroupMembers (GroupCount + 1 entries).
+	u32*                    GroupMembers;       // Machine indices, grouped.  The first of each group is run.
+	u32*                    GroupOf;            // Group of each machine (used for grouping).
+	u32*                    GroupFill;          // Fill position of each group (used for grouping).
+	u32*                    GroupTable;         // Hash table of group leaders (used for grouping).
+	u32                     GroupTableSize;     // Size of the hash table (power of two).
+
+	ram_search**            Searches;           // RAM search of each machine (optional).
+
+	std::mutex              Mutex;
+	std::condition_variable Start;              // Signals workers to start a run.
+	std::condition_variable Done;               // Signals the caller that all workers are done.
+	u64                     Generation;         // Incremented for each run.
+	u32                     ActiveCount;        // Workers still running.
+	u32                     FrameCount;         // Frames to run each machine for.
+	bool                    Exit;
+};
+
+static f64 GetTime()
+{
+	using clock = std::chrono::steady_clock;
+	return std::chrono::duration<f64>(clock::now().time_since_epoch()).count();
+}
+
+// Hashes the whole machine state, to find the machines that are identical.
+static u64 HashGroupKey(const machine& Machine)
+{
+	const u8* P = (const u8*)(const machine_state*)&Machine;
+	u64 Hash = 0xCBF29CE484222325;
+	for (u32 I = 0; I + 8 <= sizeof(machine_state); I += 8) {
+		u64 Word;
+		memcpy(&Word, P + I, 8);
+		Hash = (Hash ^ Word) * 0x100000001B3;
+		Hash ^= Hash >> 29;
+	}
+	return Hash;
+}
+
+static bool CanRunInLockstep(const machine& Machine)
+{
+	return !Machine.InputPoll && !Machine.Movie && !Machine.TraceEnable;
+}
+
+// Host settings that change how the state evolves (audio disabled freezes
+// the channel timers), or what is produced for the followers.
+static bool HaveSameSettings(const machine& A, const machine& B)
+{
+	return A.VideoDisable == B.VideoDisable
+	    && A.AudioDisable == B.AudioDisable
+	    && A.AudioSampleRate == B.AudioSampleRate
+	    && A.IndexOutput == B.IndexOutput;
+}
+
+// Sorts the machines into groups of identical machines.  The first machine
+// of each group (the one with the lowest index) is its leader.
+static void BuildGroups(batch* Batch)
+{
+	u32 GroupCount = 0;
+	u32 Mask = Batch->GroupTableSize - 1;
+
+	if (Batch->Lockstep)
+		memset(Batch->GroupTable, 0xFF, Batch->GroupTableSize * sizeof(u32));
+
+	for (u32 I = 0; I < Batch->MachineCount; I++) {
+		machine& Machine = Batch->Machines[I];
+		u32 Group = ~0u;
+
+		if (Batch->Lockstep && CanRunInLockstep(Machine)) {
+			for (u32 Slot = u32(HashGroupKey(Machine)) & Mask; ; Slot = (Slot + 1) & Mask) {
+				u32 Leader = Batch->GroupTable[Slot];
+				if (Leader == ~0u) {
+					Batch->GroupTable[Slot] = I;
+					break;
+				}
+				if (HaveSameSettings(Batch->Machines[Leader], Machine)
+				 && memcmp((machine_state*)&Batch->Machines[Leader], (machine_state*)&Machine, sizeof(machine_state)) == 0) {
+					Group = Batch->GroupOf[Leader];
+					break;
+				}
+			}
+		}
+
+		if (Group == ~0u) Group = GroupCount++;
+		Batch->GroupOf[I] = Group;
+	}
+
+	// Counting sort by group, keeping the machines of each group in order.
+	memset(Batch->GroupStart, 0, (GroupCount + 1) * sizeof(u32));
+	for (u32 I = 0; I < Batch->MachineCount; I++)
+		Batch->GroupStart[Batch->GroupOf[I] + 1] += 1;
+	for (u32 G = 0; G < GroupCount; G++) {
+		Batch->GroupStart[G + 1] += Batch->GroupStart[G];
+		Batch->GroupFill[G] = Batch->GroupStart[G];
+	}
+	for (u32 I = 0; I < Batch->MachineCount; I++)
+		Batch->GroupMembers[Batch->GroupFill[Batch->GroupOf[I]]++] = I;
+
+	Batch->GroupCount = GroupCount;
+}
+
+static void RunGroup(batch* Batch, u32 Group, batch_worker& Worker)
+{
+	u32 First = Batch->GroupStart[Group];
+	u32 Last = Batch->GroupStart[Group + 1];
+
+	machine& Leader = Batch->Machines[Batch->GroupMembers[First]];
+	for (u32 I = 0; I < Batch->FrameCount; I++) {
+		RunUntilVerticalBlank(Leader);
+		Leader.AudioPointer = 0;
+
+		// The whole group is identical to the leader on every frame.
+		for (u32 K = First; K < Last; K++) {
+			ram_search* Search = Batch->Searches[Batch->GroupMembers[K]];
+			if (Search) AddRAMSnapshot(Search, Leader);
+		}
+	}
+	Worker.Stats.FrameCount += Batch->FrameCount;
+
+	// Copy the result to the rest of the group.  Only the frame
+	// buffers written during the run need to be copied.
+	for (u32 K = First + 1; K < Last; K++) {
+		machine& Machine = Batch->Machines[Batch->GroupMembers[K]];
+		(machine_state&)Machine = Leader;
+		MarkAllPagesDirty(Machine);
+		for (u32 I = 0; I < 2 && I < Batch->FrameCount; I++) {
+			u32 Index = (Leader.PPU.Frame - I) & 1;
+			memcpy(Machine.FrameBuffer[Index], Leader.FrameBuffer[Index], 256 * 240 * sizeof(u32));
+		}
+		if (Leader.IndexOutput)
+			memcpy(Machine.IndexBuffer, Leader.IndexBuffer, 256 * 240);
+		Worker.Stats.SharedFrameCount += Batch->FrameCount;
+	}
+}
+
+static void RunWorker(batch* Batch, u32 WorkerIndex)
+{
+	batch_worker& Worker = Batch->Workers[WorkerIndex];
+	f64 StartTime = GetTime();
+
+	// Own range first.
+	for (;;) {
+		u32 Index = Worker.Next.fetch_add(1, std::memory_order_relaxed);
+		if (Index >= Worker.End) break;
+		RunGroup(Batch, Index, Worker);
+	}
+
+	// Then steal from the others.
+	for (u32 K = 1; K < Batch->WorkerCount; K++) {
+		batch_worker& Victim = Batch->Workers[(WorkerIndex + K) % Batch->WorkerCount];
+		for (;;) {
+			u32 Index = Victim.Next.fetch_add(1, std::memory_order_relaxed);
+			if (Index >= Victim.End) break;
+			RunGroup(Batch, Index, Worker);
+			Worker.Stats.StealCount += 1;
+		}
+	}
+
+	Worker.Stats.BusyTime += GetTime() - StartTime;
+}
+
+static void RunWorkerThread(batch* Batch, u32 WorkerIndex)
+{
+	u64 Generation = 0;
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> Lock(Batch->Mutex);
+			Batch->Start.wait(Lock, [&] { return Batch->Exit || Batch->Generation != Generation; });
+			if (Batch->Exit) return;
+			Generation = Batch->Generation;
+		}
+
+		RunWorker(Batch, WorkerIndex);
+
+		std::lock_guard<std::mutex> Lock(Batch->Mutex);
+		if (--Batch->ActiveCount == 0)
+			Batch->Done.notify_one();
+	}
+}
+
+// Creates a batch of machines loaded with the given ROM.  A thread count
+// of 0 uses one thread per hardware thread.  Returns null on failure.
+batch* CreateBatch(const char* Path, u32 MachineCount, u32 ThreadCount)
+{
+	if (ThreadCount == 0) ThreadCount = std::thread::hardware_concurrency();
+	if (ThreadCount == 0) ThreadCount = 1;
+
+	// The machines share a single copy of the ROM.
+	rom* ROM = OpenROM(Path);
+	if (!ROM) return nullptr;
+
+	batch* Batch = new batch();
+	Batch->Machines = new machine[MachineCount]();
+	Batch->MachineCount = MachineCount;
+
+	for (u32 I = 0; I < MachineCount; I++) {
+		if (Load(Batch->Machines[I], ROM) < 0) {
+			ReleaseROM(ROM);
+			Batch->WorkerCount = 0;
+			DestroyBatch(Batch);
+			return nullptr;
+		}
+	}
+
+	ReleaseROM(ROM);
+
+	Batch->GroupTableSize = 1;
+	while (Batch->GroupTableSize < 2 * MachineCount) Batch->GroupTableSize <<= 1;
+
+	Batch->GroupStart   = (u32*)calloc(MachineCount + 1, sizeof(u32));
+	Batch->GroupMembers = (u32*)calloc(MachineCount, sizeof(u32));
+	Batch->GroupOf      = (u32*)calloc(MachineCount, sizeof(u32));
+	Batch->GroupFill    = (u32*)calloc(MachineCount, sizeof(u32));
+	Batch->GroupTable   = (u32*)calloc(Batch->GroupTableSize, sizeof(u32));
+	Batch->Searches     = (ram_search**)calloc(MachineCount, sizeof(ram_search*));
+
+	Batch->Workers = new batch_worker[ThreadCount]();
+	Batch->WorkerCount = ThreadCount;
+
+	for (u32 I = 1; I < ThreadCount; I++)
+		Batch->Workers[I].Thread = std::thread(RunWorkerThread, Batch, I);
+
+	return Batch;
+}
+
+void DestroyBatch(batch* Batch)
+{
+	if (!Batch) return;
+
+	{
+		std::lock_guard<std::mutex> Lock(Batch->Mutex);
+		Batch->Exit = true;
+	}
+	Batch->Start.notify_all();
+
+	for (u32 I = 1; I < Batch->WorkerCount; I++)
+		Batch->Workers[I].Thread.join();
+
+	for (u32 I = 0; I < Batch->MachineCount; I++)
+		FreeMachine(Batch->Machines[I]);
+
+	delete[] Batch->Machines;
+	free(Batch->GroupStart);
+	free(Batch->GroupMembers);
+	free(Batch->GroupOf);
+	free(Batch->GroupFill);
+	free(Batch->GroupTable);
+	free(Batch->Searches);
+	delete[] Batch->Workers;
+	delete Batch;
+}
+
+u32 GetBatchSize(batch* Batch)
+{
+	return Batch->MachineCount;
+}
+
+// The machines can be accessed directly (to set input, or to read the
+// frame buffer and RAM) while the batch is not running.
+machine* GetBatchMachine(batch* Batch, u32 Index)
+{
+	return &Batch->Machines[Index];
+}
+
+void SetBatchLockstep(batch* Batch, bool Enable)
+{
+	Batch->Lockstep = Enable;
+}
+
+// Gives a machine a RAM search (owned by the caller) to add a snapshot to
+// after every frame, or removes it if null.
+void SetBatchRAMSearch(batch* Batch, u32 Index, ram_search* Search)
+{
+	Batch->Searches[Index] = Search;
+}
+
+// Runs every machine for the given number of frames, and returns when all
+// of them are done.  Returns the number of machines actually emulated.
+u32 RunBatch(batch* Batch, u32 FrameCount)
+{
+	BuildGroups(Batch);
+
+	// Split the groups evenly between the workers.
+	for (u32 I = 0; I < Batch->WorkerCount; I++) {
+		batch_worker& Worker = Batch->Workers[I];
+		Worker.Next.store(u32(u64(Batch->GroupCount) * I / Batch->WorkerCount), std::memory_order_relaxed);
+		Worker.End = u32(u64(Batch->GroupCount) * (I + 1) / Batch->WorkerCount);
+	}
+
+	{
+		std::lock_guard<std::mutex> Lock(Batch->Mutex);
+		Batch->FrameCount = FrameCount;
+		Batch->ActiveCount = Batch->WorkerCount - 1;
+		Batch->Generation += 1;
+	}
+	Batch->Start.notify_all();
+
+	RunWorker(Batch, 0);
+
+	std::unique_lock<std::mutex> Lock(Batch->Mutex);
+	Batch->Done.wait(Lock, [Batch] { return Batch->ActiveCount == 0; });
+
+	return Batch->GroupCount;
+}
+
+// Copies the per-thread statistics, and returns the number of threads.
+u32 GetBatchThreadStats(batch* Batch, batch_thread_stats* Stats, u32 Count)
+{
+	for (u32 I = 0; I < Count && I < Batch->WorkerCount; I++)
+		Stats[I] = Batch->Workers[I].Stats;
+	return Batch->WorkerCount;
+}
@@ -0,0 +1,349 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+
+#include "nes.h"
+
+// Headless benchmark.  Runs a ROM for a fixed number of frames in each of
+// the configurations below and reports the achieved emulation speed.
+
+struct benchmark
+{
+	const char*     Name;
+	void          (*Setup)(machine& Machine);
+	void          (*Frame)(machine& Machine);   // Called after each frame (optional).
+	void          (*Finish)(machine& Machine);  // Reports additional results (optional).
+};
+
+static void SetupDefault(machine& Machine)
+{
+	Machine.AudioSampleRate = 44100;
+}
+
+static void SetupNoAudio(machine& Machine)
+{
+	Machine.AudioDisable = true;
+}
+
+static void SetupNoVideo(machine& Machine)
+{
+	SetupDefault(Machine);
+	Machine.VideoDisable = true;
+}
+
+static void SetupTrace(machine& Machine)
+{
+	SetupDefault(Machine);
+#ifdef _WIN32
+	OpenTrace(Machine, "NUL");
+#else
+	OpenTrace(Machine, "/dev/null");
+#endif
+}
+
+static void SetupTraceCapture(machine& Machine)
+{
+	SetupDefault(Machine);
+	OpenTrace(Machine, nullptr);
+}
+
+// Trace only instructions accessing the PPU and APU registers.
+static void SetupTraceFilter(machine& Machine)
+{
+	trace_filter Filter;
+	InitTraceFilter(Filter);
+	Filter.Flags |= TraceFilterAccess;
+	SetTraceFilterRange(Filter.Access, 0x2000, 0x3FFF, true);
+	SetTraceFilterRange(Filter.Access, 0x4000, 0x4017, true);
+	SetTraceFilter(Machine, &Filter);
+	SetupTraceCapture(Machine);
+}
+
+// Save and restore the machine state after every frame.
+static void FrameSaveState(machine& Machine)
+{
+	static u8 State[65536];
+	SaveState(Machine, State, sizeof(State));
+	LoadState(Machine, State, sizeof(State));
+}
+
+static machine Machine;
+static rewind_buffer* Rewind;
+static fork_node** Forks;
+static u32 ForkCount;
+
+// Fork every frame from the previous fork, keeping all of the forks.
+static void FrameFork(machine& Machine)
+{
+	Forks = (fork_node**)realloc(Forks, (ForkCount + 1) * sizeof(fork_node*));
+	Forks[ForkCount] = Fork(Machine, ForkCount > 0 ? Forks[ForkCount - 1] : nullptr);
+	ForkCount += 1;
+}
+
+// Report the memory held by the forks.
+static void FinishFork(machine& Machine)
+{
+	f64 Size = 0.0;
+	for (u32 I = 0; I < ForkCount; I++)
+		Size += GetForkMemorySize(Forks[I]);
+
+	printf("  %.1f KB per fork, %.1f KB per save state\n",
+		Size / ForkCount / 1024.0, GetStateSize(Machine) / 1024.0);
+
+	for (u32 I = 0; I < ForkCount; I++)
+		ReleaseFork(Forks[I]);
+	free(Forks);
+	Forks = nullptr;
+	ForkCount = 0;
+}
+
+// Produce a stacked 84x84 grayscale observation after every frame
+// from the palette indices, without RGBA output.
+static observation* Observation;
+static u8* ObservationStack;
+
+static void SetupObservation(machine& Machine)
+{
+	SetupNoVideo(Machine);
+	Machine.IndexOutput = true;
+
+	observation_config Config = {};
+	Config.MaxPool = true;
+	if (!Observation) {
+		Observation = CreateObservation(Config);
+		ObservationStack = (u8*)malloc(GetObservationSize(Observation));
+	}
+	ResetObservation(Observation, Machine, ObservationStack);
+}
+
+static void FrameObservation(machine& Machine)
+{
+	UpdateObservation(Observation, Machine, ObservationStack);
+}
+
+// Add every frame to an archive keyed by the state hash, like an
+// exploration loop checking for new states.
+static archive* Archive;
+static u32 ArchiveFrame;
+
+static void SetupArchive(machine& Machine)
+{
+	SetupNoVideo(Machine);
+	Archive = CreateArchive(nullptr, nullptr, StateHashRAM | StateHashPRGRAM | StateHashPPU);
+	ArchiveFrame = 0;
+}
+
+static void FrameArchive(machine& Machine)
+{
+	UpdateArchive(Archive, Machine, 0.0, ++ArchiveFrame);
+}
+
+static void FinishArchive(machine&)
+{
+	printf("  %u cells\n", GetArchiveSize(Archive));
+	DestroyArchive(Archive);
+	Archive = nullptr;
+}
+
+// Run two frames ahead after every frame, like the frontend does.
+static void SetupRunAhead(machine& Machine)
+{
+	SetupDefault(Machine);
+	Machine.VideoDisable = true;
+}
+
+static void FrameRunAhead(machine& Machine)
+{
+	static u8 State[65536];
+	SaveState(Machine, State, sizeof(State));
+	Machine.AudioDisable = true;
+	RunUntilVerticalBlank(Machine);
+	Machine.VideoDisable = false;
+	RunUntilVerticalBlank(Machine);
+	LoadState(Machine, State, sizeof(State));
+	Machine.AudioDisable = false;
+	Machine.VideoDisable = true;
+}
+
+static f64 Now()
+{
+	using clock = std::chrono::steady_clock;
+	return std::chrono::duration<f64>(clock::now().time_since_epoch()).count();
+}
+
+// Record every frame into a rewind buffer.
+static void SetupRewind(machine& Machine)
+{
+	SetupDefault(Machine);
+	if (!Rewind) Rewind = CreateRewindBuffer(256 << 20, 1 << 20);
+	ClearRewindBuffer(Rewind);
+}
+
+static void FrameRewind(machine& Machine)
+{
+	PushRewindFrame(Rewind, Machine);
+}
+
+// Report the rewind history size, and the time to step back through it.
+static void FinishRewind(machine& Machine)
+{
+	FlushRewindBuffer(Rewind);
+
+	rewind_stats Stats;
+	GetRewindStats(Rewind, Stats);
+
+	f64 StartTime = Now();
+	u32 StepCount = 0;
+	while (PopRewindFrame(Rewind, Machine) == 0)
+		StepCount += 1;
+	f64 Seconds = Now() - StartTime;
+
+	printf("  %u frames, %u keyframes, %.1f KB/frame, %.2f MB/minute, %.2f us/step\n",
+		Stats.FrameCount, Stats.KeyframeCount,
+		Stats.ByteCount / 1024.0 / Stats.FrameCount,
+		Stats.ByteCount * 3600.0 / Stats.FrameCount / (1 << 20),
+		Seconds * 1e6 / StepCount);
+}
+
+const benchmark BenchmarkTable[] =
+{
+	{ "default",       SetupDefault,      nullptr,          nullptr       },
+	{ "no-audio",      SetupNoAudio,      nullptr,          nullptr       },
+	{ "no-video",      SetupNoVideo,      nullptr,          nullptr       },
+	{ "trace",         SetupTrace,        nullptr,          nullptr       },
+	{ "trace-capture", SetupTraceCapture, nullptr,          nullptr       },
+	{ "trace-filter",  SetupTraceFilter,  nullptr,          nullptr       },
+	{ "save-state",    SetupDefault,      FrameSaveState,   nullptr       },
+	{ "fork",          SetupDefault,      FrameFork,        FinishFork    },
+	{ "observation",   SetupObservation,  FrameObservation, nullptr       },
+	{ "archive",       SetupArchive,      FrameArchive,     FinishArchive },
+	{ "rewind",        SetupRewind,       FrameRewind,      FinishRewind  },
+	{ "run-ahead-2",   SetupRunAhead,     FrameRunAhead,    nullptr       },
+};
+
+// Runs a batch of machines, and reports the total speed and the speed of
+// each thread.  The machines are given InputGroupCount different inputs
+// (changing every run), and machines with the same input can be run in
+// lockstep.
+static void RunBatchConfig(const char* Path, u32 MachineCount, u32 ThreadCount, u32 RunCount, u32 FramesPerRun, bool Lockstep, u32 InputGroupCount)
+{
+	batch* Batch = CreateBatch(Path, MachineCount, ThreadCount);
+	if (!Batch) {
+		printf("Failed to load %s\n", Path);
+		return;
+	}
+
+	SetBatchLockstep(Batch, Lockstep);
+
+	f64 StartTime = Now();
+	for (u32 I = 0; I < RunCount; I++) {
+		for (u32 K = 0; K < MachineCount; K++)
+			GetBatchMachine(Batch, K)->Input[0] = u8((K % InputGroupCount) * (I + 1));
+		RunBatch(Batch, FramesPerRun);
+	}
+	f64 Seconds = Now() - StartTime;
+
+	batch_thread_stats Stats[256];
+	u32 StatsCount = GetBatchThreadStats(Batch, Stats, 256);
+	if (StatsCount > 256) StatsCount = 256;
+
+	u64 Frames = 0, Steals = 0;
+	f64 ThreadFPS = 0.0;
+	for (u32 I = 0; I < StatsCount; I++) {
+		Frames += Stats[I].FrameCount + Stats[I].SharedFrameCount;
+		Steals += Stats[I].StealCount;
+		if (Stats[I].BusyTime > 0.0) ThreadFPS += (Stats[I].FrameCount + Stats[I].SharedFrameCount) / Stats[I].BusyTime;
+	}
+	ThreadFPS /= StatsCount;
+
+	char Name[32];
+	if (Lockstep)
+		snprintf(Name, sizeof(Name), "lockstep %u/%u", InputGroupCount, MachineCount);
+	else
+		snprintf(Name, sizeof(Name), "%u machines/%u", MachineCount, ThreadCount);
+	printf("%-16s %8llu %10.3f %10.1f %12.1f %8llu\n", Name,
+		(unsigned long long)Frames, Seconds, Frames / Seconds, ThreadFPS, (unsigned long long)Steals);
+
+	if (!Lockstep && ThreadCount == 1) {
+		machine* Machine = GetBatchMachine(Batch, 0);
+		printf("  %.1f KB per machine, %.1f KB shared ROM\n",
+			GetMachineMemorySize(*Machine) / 1024.0, Machine->ROM->DataSize / 1024.0);
+	}
+
+	DestroyBatch(Batch);
+}
+
+// Runs batches of machines with increasing thread counts, to see how the
+// batch runner scales, and then in lockstep mode with different numbers
+// of distinct inputs.  The total amount of work is the same in each run.
+static void RunBatchBenchmark(const char* Path, i32 FrameCount)
+{
+	u32 MaxThreadCount = std::thread::hardware_concurrency();
+	if (MaxThreadCount == 0) MaxThreadCount = 1;
+
+	u32 MachineCount = 4 * MaxThreadCount;
+	u32 FramesPerRun = 10;
+	u32 RunCount = u32(FrameCount) / (MachineCount * FramesPerRun);
+	if (RunCount == 0) RunCount = 1;
+
+	printf("\n%-16s %8s %10s %10s %12s %8s\n", "batch", "frames", "seconds", "fps", "fps/thread", "steals");
+
+	for (u32 ThreadCount = 1; ; ThreadCount *= 2) {
+		if (ThreadCount > MaxThreadCount) ThreadCount = MaxThreadCount;
+		RunBatchConfig(Path, MachineCount, ThreadCount, RunCount, FramesPerRun, false, 1);
+		if (ThreadCount == MaxThreadCount) break;
+	}
+
+	for (u32 InputGroupCount = 1; InputGroupCount < MachineCount; InputGroupCount *= 2)
+		RunBatchConfig(Path, MachineCount, MaxThreadCount, RunCount, FramesPerRun, true, InputGroupCount);
+}
+
+int main(int argc, char* args[])
+{
+	if (argc < 2) {
+		printf("usage: nesbench <rom> [frames]\n");
+		return -1;
+	}
+
+	const char* Path = args[1];
+	i32 FrameCount = argc > 2 ? atoi(args[2]) : 3600;
+
+	printf("%-16s %8s %10s %10s %8s\n", "config", "frames", "seconds", "fps", "speed");
+
+	for (const benchmark& B : BenchmarkTable) {
+		if (Load(Machine, Path) < 0) {
+			printf("Failed to load %s\n", Path);
+			return -1;
+		}
+
+		B.Setup(Machine);
+
+		f64 StartTime = Now();
+
+		for (i32 I = 0; I < FrameCount; I++) {
+			RunUntilVerticalBlank(Machine);
+			if (B.Frame) B.Frame(Machine);
+			// Discard the audio, like the frontend does after queueing it.
+			Machine.AudioPointer = 0;
+		}
+
+		f64 Seconds = Now() - StartTime;
+		f64 FPS = FrameCount / Seconds;
+
+		CloseTrace(Machine);
+
+		printf("%-16s %8d %10.3f %10.1f %7.2fx\n", B.Name, FrameCount, Seconds, FPS, FPS / 60.0988);
+
+		if (B.Finish) B.Finish(Machine);
+	}
+
+	DestroyRewindBuffer(Rewind);
+	DestroyObservation(Observation);
+	free(ObservationStack);
+
+	RunBatchBenchmark(Path, FrameCount);
+
+	return 0;
+}
@@ -1,6 +1,7 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "nes.h"
 
@@ -705,98 +706,181 @@ static void Operate(machine& Machine, u8 Operation)
 	}
 }
 
+static bool PassTraceFilter(machine& Machine, const trace_filter& Filter, bool IsInterrupt)
+{
+	cpu& CPU = Machine.CPU;
+
+	if (IsInterrupt)
+		return Filter.Flags & TraceFilterInterrupts;
+
+	if (!TestTraceFilterBit(Filter.PC, CPU.InstructionPC))
+		return false;
+
+	if (!TestTraceFilterBit(Filter.Opcode, CPU.Instruction.Opcode))
+		return false;
+
+	// Only instructions with a memory operand access an address.
+	if (Filter.Flags & TraceFilterAccess) {
+		if (!CPU.Instruction.MemoryOperationState) return false;
+		if (!TestTraceFilterBit(Filter.Access, CPU.Address)) return false;
+	}
+
+	if ((Filter.Flags & TraceFilterPRGBank) && CPU.InstructionPC >= 0x8000) {
+		u32 Bank = GetPRGROMOffset(Machine, CPU.InstructionPC) / 0x2000;
+		if (Bank >= 64 || !((Filter.PRGBanks >> Bank) & 1)) return false;
+	}
+
+	return true;
+}
+
+i32 SetTraceFilterOperation(trace_filter& Filter, const char* Name, bool Value)
+{
+	i32 Count = 0;
+
+	for (u32 I = 0; I < 256; I++) {
+		if (strcmp(OperationNameTable[InstructionTable[I].Operation], Name) != 0)
+			continue;
+		SetTraceFilterRange(Filter.Opcode, I, I, Value);
+		Count += 1;
+	}
+
+	return Count;
+}
+
+// Tracing is a template parameter of the CPU core, so that the variant used
+// when tracing is disabled contains no tracing code at all.
+template <bool Tracing>
 static inline void Trace(machine& Machine)
 {
-	FILE* F = Machine.TraceFile;
-	if (!F) return;
+	if constexpr (!Tracing) return;
 
 	cpu& CPU = Machine.CPU;
 
-	u8 Opcode = CPU.Instruction.Opcode;
-	char const* OperationName = OperationNameTable[CPU.Instruction.Operation];
+	// Hardware interrupt sequences run with the previous instruction still
+	// decoded, so they are identified from the interrupt being served.
+	bool IsInterrupt = CPU.State == INTERRUPT_JUMP + 3 && CPU.Interrupt != NO_INTERRUPT;
+
+	if (Machine.TraceFilter && !PassTraceFilter(Machine, *Machine.TraceFilter, IsInterrupt))
+		return;
+
+	trace_record Record = {};
+
+	Record.Cycle     = CPU.Cycle;
+	Record.PC        = CPU.InstructionPC;
+	Record.Immediate = CPU.Immediate;
+	Record.Address   = CPU.Address;
+	Record.ScanY     = Machine.PPU.ScanY;
+	Record.ScanX     = Machine.PPU.ScanX;
+	Record.Opcode    = CPU.Instruction.Opcode;
+	Record.A         = CPU.A;
+	Record.X         = CPU.X;
+	Record.Y         = CPU.Y;
+	Record.SP        = CPU.SP;
+
+	if (IsInterrupt)
+		Record.Interrupt = CPU.Interrupt;
+
+	Record.P = 0x20
+		| u8(CPU.NF) << 7
+		| u8(CPU.VF) << 6
+		| u8(CPU.BF) << 4
+		| u8(CPU.DF) << 3
+		| u8(CPU.IF) << 2
+		| u8(CPU.ZF) << 1
+		| u8(CPU.CF) << 0
+		;
+
+	WriteTraceRecord(Machine, Record);
+}
+
+i32 FormatTraceRecord(char* Buffer, i32 Size, const trace_record& Record, bool Timing)
+{
+	u8 Opcode = Record.Opcode;
+	u16 Immediate = Record.Immediate;
+	const cpu_instruction& Instruction = InstructionTable[Opcode];
+	char const* OperationName = OperationNameTable[Instruction.Operation];
 
 	char C1[16] = {0};
-	char C2[16] = {0};
+	char C2[32] = {0};
 
-	switch (CPU.Instruction.InitialState & ~7) {
-		case RESET:
-			sprintf(C2, "--- RESET ---");
-			break;
+	switch (Record.Interrupt ? INTERRUPT_JUMP : Instruction.InitialState & ~7) {
 		case STACK_PUSH:
 		case STACK_PULL:
 		case IMPLIED:
 		case ACCUMULATOR:
 		case SUBROUTINE_RETURN:
 		case INTERRUPT_RETURN:
-			sprintf(C1, "%02X", Opcode);
-			sprintf(C2, OperationName);
+			snprintf(C1, sizeof(C1), "%02X", Opcode);
+			snprintf(C2, sizeof(C2), "%s", OperationName);
 			break;
 		case INTERRUPT_JUMP:
-			if (CPU.Interrupt == NO_INTERRUPT) {
-				sprintf(C1, "%02X", Opcode);
-				sprintf(C2, OperationName);
+			if (Record.Interrupt == NO_INTERRUPT) {
+				snprintf(C1, sizeof(C1), "%02X", Opcode);
+				snprintf(C2, sizeof(C2), "%s", OperationName);
 			}
 			else {
-				sprintf(C1, "--");
-				sprintf(C2, "*** %s ***", (CPU.Interrupt == NMI ? "NMI" : "IRQ"));
+				snprintf(C1, sizeof(C1), "--");
+				snprintf(C2, sizeof(C2), "*** %s ***", (Record.Interrupt == NMI ? "NMI" : "IRQ"));
 			}
 			break;
 		case BRANCH:
-			sprintf(C1, "%02X %02X", Opcode, CPU.Immediate);
-			sprintf(C2, "%s $%02X", OperationName, CPU.Address);
+			snprintf(C1, sizeof(C1), "%02X %02X", Opcode, Immediate);
+			snprintf(C2, sizeof(C2), "%s $%02X", OperationName, Record.Address);
 			break;
 		case IMMEDIATE:
-			sprintf(C1, "%02X %02X", Opcode, CPU.Immediate);
-			sprintf(C2, "%s #$%02X", OperationName, CPU.Immediate);
+			snprintf(C1, sizeof(C1), "%02X %02X", Opcode, Immediate);
+			snprintf(C2, sizeof(C2), "%s #$%02X", OperationName, Immediate);
 			break;
 		case ZERO_PAGE:
-			sprintf(C1, "%02X %02X", Opcode, CPU.Immediate);
-			sprintf(C2, "%s $%02X", OperationName, CPU.Immediate);
+			snprintf(C1, sizeof(C1), "%02X %02X", Opcode, Immediate);
+			snprintf(C2, sizeof(C2), "%s $%02X", OperationName, Immediate);
 			break;
 		case ZERO_PAGE_X:
-			sprintf(C1, "%02X %02X", Opcode, CPU.Immediate);
-			sprintf(C2, "%s $%02X,X", OperationName, CPU.Immediate);
+			snprintf(C1, sizeof(C1), "%02X %02X", Opcode, Immediate);
+			snprintf(C2, sizeof(C2), "%s $%02X,X", OperationName, Immediate);
 			break;
 		case ZERO_PAGE_Y:
-			sprintf(C1, "%02X %02X", Opcode, CPU.Immediate);
-			sprintf(C2, "%s $%02X,Y", OperationName, CPU.Immediate);
+			snprintf(C1, sizeof(C1), "%02X %02X", Opcode, Immediate);
+			snprintf(C2, sizeof(C2), "%s $%02X,Y", OperationName, Immediate);
 			break;
 		case SUBROUTINE_JUMP:
 		case ABSOLUTE_JUMP:
-			sprintf(C1, "%02X %02X %02X", Opcode, CPU.Immediate & 0xFF, CPU.Immediate >> 8);
-			sprintf(C2, "%s $%04X", OperationName, CPU.Immediate);
-			break;
 		case ABSOLUTE:
-			sprintf(C1, "%02X %02X %02X", Opcode, CPU.Immediate & 0xFF, CPU.Immediate >> 8);
-			sprintf(C2, "%s $%04X", OperationName, CPU.Immediate);
+			snprintf(C1, sizeof(C1), "%02X %02X %02X", Opcode, Immediate & 0xFF, Immediate >> 8);
+			snprintf(C2, sizeof(C2), "%s $%04X", OperationName, Immediate);
 			break;
 		case ABSOLUTE_X:
-			sprintf(C1, "%02X %02X %02X", Opcode, CPU.Immediate & 0xFF, CPU.Immediate >> 8);
-			sprintf(C2, "%s $%04X,X", OperationName, CPU.Immediate);
+			snprintf(C1, sizeof(C1), "%02X %02X %02X", Opcode, Immediate & 0xFF, Immediate >> 8);
+			snprintf(C2, sizeof(C2), "%s $%04X,X", OperationName, Immediate);
 			break;
 		case ABSOLUTE_Y:
-			sprintf(C1, "%02X %02X %02X", Opcode, CPU.Immediate & 0xFF, CPU.Immediate >> 8);
-			sprintf(C2, "%s $%04X,Y", OperationName, CPU.Immediate);
+			snprintf(C1, sizeof(C1), "%02X %02X %02X", Opcode, Immediate & 0xFF, Immediate >> 8);
+			snprintf(C2, sizeof(C2), "%s $%04X,Y", OperationName, Immediate);
 			break;
 		case INDIRECT_JUMP:
-			sprintf(C1, "%02X %02X %02X", Opcode, CPU.Immediate & 0xFF, CPU.Immediate >> 8);
-			sprintf(C2, "%s ($%04X)", OperationName, CPU.Immediate);
+			snprintf(C1, sizeof(C1), "%02X %02X %02X", Opcode, Immediate & 0xFF, Immediate >> 8);
+			snprintf(C2, sizeof(C2), "%s ($%04X)", OperationName, Immediate);
 			break;
 		case INDEXED_INDIRECT:
-			sprintf(C1, "%02X %02X", Opcode, CPU.Immediate);
-			sprintf(C2, "%s (%02X,X)", OperationName, CPU.Immediate);
+			snprintf(C1, sizeof(C1), "%02X %02X", Opcode, Immediate);
+			snprintf(C2, sizeof(C2), "%s (%02X,X)", OperationName, Immediate);
 			break;
 		case INDIRECT_INDEXED:
-			sprintf(C1, "%02X %02X", Opcode, CPU.Immediate);
-			sprintf(C2, "%s (%02X),Y", OperationName, CPU.Immediate);
+			snprintf(C1, sizeof(C1), "%02X %02X", Opcode, Immediate);
+			snprintf(C2, sizeof(C2), "%s (%02X),Y", OperationName, Immediate);
 			break;
 	}
 
-	fprintf(F,
-		"%04X  %-8s  %-30s A:%02X X:%02X Y:%02X SP:%02X\n",
-		CPU.InstructionPC, C1, C2, CPU.A, CPU.X, CPU.Y, CPU.SP);
+	if (Timing) {
+		return snprintf(Buffer, Size,
+			"%04X  %-8s  %-30s A:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3u,%3u CYC:%llu\n",
+			Record.PC, C1, C2, Record.A, Record.X, Record.Y, Record.P, Record.SP,
+			Record.ScanY, Record.ScanX, (unsigned long long)Record.Cycle);
+	}
 
-	Machine.TraceLine++;
+	return snprintf(Buffer, Size,
+		"%04X  %-8s  %-30s A:%02X X:%02X Y:%02X SP:%02X\n",
+		Record.PC, C1, C2, Record.A, Record.X, Record.Y, Record.SP);
 }
 
 #define STALL if (CPU.Stall > 0) { CPU.Stall--; break; }
@@ -806,6 +890,7 @@ static inline bool IsSamePage(u16 A, u16 B)
 	return (A & 0xFF00) == (B & 0xFF00);
 }
 
+template <i32 MapperID, bool Tracing>
 void StepCPU(machine& Machine)
 {
 	cpu& CPU = Machine.CPU;
@@ -831,26 +916,26 @@ void StepCPU(machine& Machine)
 		case RESET:
 		case RESET +1:
 			STALL;
-			Read(Machine, PC);
+			Read<MapperID>(Machine, PC);
 			State++;
 			break;
 		case RESET +2:
 		case RESET +3:
 		case RESET +4:
 			STALL;
-			Read(Machine, 0x100 | SP--);
+			Read<MapperID>(Machine, 0x100 | SP--);
 			State++;
 			break;
 		case RESET +5:
 			STALL;
-			PC = Read(Machine, 0xFFFC);
+			PC = Read<MapperID>(Machine, 0xFFFC);
 			BF = true;
 			IF = true;
 			State++;
 			break;
 		case RESET +6:
 			STALL;
-			PC |= Read(Machine, 0xFFFD) << 8;
+			PC |= Read<MapperID>(Machine, 0xFFFD) << 8;
 			State = FETCH;
 			break;
 
@@ -860,13 +945,13 @@ void StepCPU(machine& Machine)
 		case FETCH_NO_POLL:
 			STALL;
 			if (CPU.Interrupt) {
-				Read(Machine, PC);
+				Read<MapperID>(Machine, PC);
 				// Start interrupt sequence for IRQ.
 				State = INTERRUPT_JUMP;
 			}
 			else {
 				InstructionPC = PC;
-				Instruction = InstructionTable[Read(Machine, PC++)];
+				Instruction = InstructionTable[Read<MapperID>(Machine, PC++)];
 				State = Instruction.InitialState;
 				//printf("I %s\n", OperationNameTable[Instruction.Operation]);
 			}
@@ -877,16 +962,16 @@ void StepCPU(machine& Machine)
 		// Used for NMI, IRQ, and the BRK instruction.
 		case INTERRUPT_JUMP:
 			STALL;
-			Read(Machine, PC);
+			Read<MapperID>(Machine, PC);
 			if (Instruction.Operation == BRK) PC++;
 			State++;
 			break;
 		case INTERRUPT_JUMP +1:
-			Write(Machine, 0x100 | SP--, PC >> 8);
+			Write<MapperID>(Machine, 0x100 | SP--, PC >> 8);
 			State++;
 			break;
 		case INTERRUPT_JUMP +2:
-			Write(Machine, 0x100 | SP--, PC & 0xFF);
+			Write<MapperID>(Machine, 0x100 | SP--, PC & 0xFF);
 			State++;
 			break;
 		case INTERRUPT_JUMP +3:
@@ -912,20 +997,20 @@ void StepCPU(machine& Machine)
 					IF = true;
 					break;
 			}
-			Trace(Machine);
-			Write(Machine, 0x100 | SP--, Operand);
+			Trace<Tracing>(Machine);
+			Write<MapperID>(Machine, 0x100 | SP--, Operand);
 			CPU.Interrupt = NO_INTERRUPT;
 			CPU.InternalNMI = false;
 			State++;
 			break;
 		case INTERRUPT_JUMP +4:
 			STALL;
-			PC = Read(Machine, Address);
+			PC = Read<MapperID>(Machine, Address);
 			State++;
 			break;
 		case INTERRUPT_JUMP +5:
 			STALL;
-			PC |= Read(Machine, Address+1) << 8;
+			PC |= Read<MapperID>(Machine, Address+1) << 8;
 			// An interrupt sequence does not poll the NMI or IRQ detectors at the end.
 			State = FETCH_NO_POLL;
 			break;
@@ -934,29 +1019,29 @@ void StepCPU(machine& Machine)
 
 		case INTERRUPT_RETURN:
 			STALL;
-			Read(Machine, PC);
+			Read<MapperID>(Machine, PC);
 			State++;
 			break;
 		case INTERRUPT_RETURN +1:
 			STALL;
-			Read(Machine, 0x100 | SP++);
+			Read<MapperID>(Machine, 0x100 | SP++);
 			State++;
 			break;
 		case INTERRUPT_RETURN +2:
 			STALL;
-			Operand = Read(Machine, 0x100 | SP++);
+			Operand = Read<MapperID>(Machine, 0x100 | SP++);
 			Operate(Machine, PLP);
 			State++;
 			break;
 		case INTERRUPT_RETURN +3:
 			STALL;
-			PC = Read(Machine, 0x100 | SP++);
+			PC = Read<MapperID>(Machine, 0x100 | SP++);
 			State++;
 			break;
 		case INTERRUPT_RETURN +4:
 			STALL;
-			PC |= Read(Machine, 0x100 | SP) << 8;
-			Trace(Machine);
+			PC |= Read<MapperID>(Machine, 0x100 | SP) << 8;
+			Trace<Tracing>(Machine);
 			State = FETCH;
 			break;
 
@@ -964,27 +1049,27 @@ void StepCPU(machine& Machine)
 
 		case SUBROUTINE_JUMP:
 			STALL;
-			Immediate = Read(Machine, PC++);
+			Immediate = Read<MapperID>(Machine, PC++);
 			State++;
 			break;
 		case SUBROUTINE_JUMP +1:
 			STALL;
-			Read(Machine, 0x100 | SP);
+			Read<MapperID>(Machine, 0x100 | SP);
 			State++;
 			break;
 		case SUBROUTINE_JUMP +2:
-			Write(Machine, 0x100 | SP--, PC >> 8);
+			Write<MapperID>(Machine, 0x100 | SP--, PC >> 8);
 			State++;
 			break;
 		case SUBROUTINE_JUMP +3:
-			Write(Machine, 0x100 | SP--, PC & 0xFF);
+			Write<MapperID>(Machine, 0x100 | SP--, PC & 0xFF);
 			State++;
 			break;
 		case SUBROUTINE_JUMP +4:
 			STALL;
-			Immediate |= Read(Machine, PC) << 8;
+			Immediate |= Read<MapperID>(Machine, PC) << 8;
 			PC = Immediate;
-			Trace(Machine);
+			Trace<Tracing>(Machine);
 			State = FETCH;
 			break;
 
@@ -992,28 +1077,28 @@ void StepCPU(machine& Machine)
 
 		case SUBROUTINE_RETURN:
 			STALL;
-			Read(Machine, PC);
+			Read<MapperID>(Machine, PC);
 			State++;
 			break;
 		case SUBROUTINE_RETURN +1:
 			STALL;
-			Read(Machine, 0x100 | SP++);
+			Read<MapperID>(Machine, 0x100 | SP++);
 			State++;
 			break;
 		case SUBROUTINE_RETURN +2:
 			STALL;
-			PC = Read(Machine, 0x100 | SP++);
+			PC = Read<MapperID>(Machine, 0x100 | SP++);
 			State++;
 			break;
 		case SUBROUTINE_RETURN +3:
 			STALL;
-			PC |= Read(Machine, 0x100 | SP) << 8;
+			PC |= Read<MapperID>(Machine, 0x100 | SP) << 8;
 			State++;
 			break;
 		case SUBROUTINE_RETURN +4:
 			STALL;
-			Read(Machine, PC++);
-			Trace(Machine);
+			Read<MapperID>(Machine, PC++);
+			Trace<Tracing>(Machine);
 			State = FETCH;
 			break;
 
@@ -1021,13 +1106,13 @@ void StepCPU(machine& Machine)
 
 		case STACK_PUSH:
 			STALL;
-			Read(Machine, PC);
+			Read<MapperID>(Machine, PC);
 			State++;
 			break;
 		case STACK_PUSH +1:
 			Operate(Machine, Instruction.Operation);
-			Write(Machine, 0x100 | SP--, Operand);
-			Trace(Machine);
+			Write<MapperID>(Machine, 0x100 | SP--, Operand);
+			Trace<Tracing>(Machine);
 			State = FETCH;
 			break;
 
@@ -1035,19 +1120,19 @@ void StepCPU(machine& Machine)
 
 		case STACK_PULL:
 			STALL;
-			Read(Machine, PC);
+			Read<MapperID>(Machine, PC);
 			State++;
 			break;
 		case STACK_PULL +1:
 			STALL;
-			Read(Machine, 0x100 | SP++);
+			Read<MapperID>(Machine, 0x100 | SP++);
 			State++;
 			break;
 		case STACK_PULL +2:
 			STALL;
-			Operand = Read(Machine, 0x100 | SP);
+			Operand = Read<MapperID>(Machine, 0x100 | SP);
 			Operate(Machine, Instruction.Operation);
-			Trace(Machine);
+			Trace<Tracing>(Machine);
 			State = FETCH;
 			break;
 
@@ -1055,9 +1140,9 @@ void StepCPU(machine& Machine)
 
 		case IMPLIED:
 			STALL;
-			Read(Machine, PC);
+			Read<MapperID>(Machine, PC);
 			Operate(Machine, Instruction.Operation);
-			Trace(Machine);
+			Trace<Tracing>(Machine);
 			State = FETCH;
 			break;
 
@@ -1065,10 +1150,10 @@ void StepCPU(machine& Machine)
 
 		case ACCUMULATOR:
 			STALL;
-			Read(Machine, PC);
+			Read<MapperID>(Machine, PC);
 			Operand = A;
 			Operate(Machine, Instruction.Operation);
-			Trace(Machine);
+			Trace<Tracing>(Machine);
 			A = Operand;
 			State = FETCH;
 			break;
@@ -1077,10 +1162,10 @@ void StepCPU(machine& Machine)
 
 		case IMMEDIATE:
 			STALL;
-			Immediate = Read(Machine, PC++);
+			Immediate = Read<MapperID>(Machine, PC++);
 			Operand = Immediate & 0xFF;
 			Operate(Machine, Instruction.Operation);
-			Trace(Machine);
+			Trace<Tracing>(Machine);
 			State = FETCH;
 			break;
 
@@ -1088,7 +1173,7 @@ void StepCPU(machine& Machine)
 
 		case BRANCH:
 			STALL;
-			Immediate = Read(Machine, PC++);
+			Immediate = Read<MapperID>(Machine, PC++);
 			// Compute new program counter.
 			Address = PC + Immediate;
 			if (Immediate & 0x80) Address -= 0x100;
@@ -1104,28 +1189,28 @@ void StepCPU(machine& Machine)
 				case BVC: if ( VF) State = FETCH; break;
 				case BVS: if (!VF) State = FETCH; break;
 			}
-			if (State == FETCH) Trace(Machine);
+			if (State == FETCH) Trace<Tracing>(Machine);
 			break;
 		case BRANCH +1:
 			STALL;
 			// Dummy read next opcode.
-			Read(Machine, PC);
+			Read<MapperID>(Machine, PC);
 			State++;
 			// Check for page-crossing branch.
 			if (IsSamePage(Address, PC)) {
 				// Branch target is on the same page, so we're done.
 				PC = Address;
-				Trace(Machine);
+				Trace<Tracing>(Machine);
 				State = FETCH_NO_POLL;
 			}
 			break;
 		case BRANCH +2:
 			STALL;
 			// Dummy read opcode using old PCH.
-			Read(Machine, (PC & 0xFF00) | (Address & 0x00FF));
+			Read<MapperID>(Machine, (PC & 0xFF00) | (Address & 0x00FF));
 			// Finally, we have the fixed PC.
 			PC = Address;
-			Trace(Machine);
+			Trace<Tracing>(Machine);
 			State = FETCH;
 			break;
 
@@ -1133,14 +1218,14 @@ void StepCPU(machine& Machine)
 
 		case ABSOLUTE_JUMP:
 			STALL;
-			Immediate = Read(Machine, PC++);
+			Immediate = Read<MapperID>(Machine, PC++);
 			State++;
 			break;
 		case ABSOLUTE_JUMP +1:
 			STALL;
-			Immediate |= Read(Machine, PC) << 8;
+			Immediate |= Read<MapperID>(Machine, PC) << 8;
 			PC = Immediate;
-			Trace(Machine);
+			Trace<Tracing>(Machine);
 			State = FETCH;
 			break;
 
@@ -1148,24 +1233,24 @@ void StepCPU(machine& Machine)
 
 		case INDIRECT_JUMP:
 			STALL;
-			Immediate = Read(Machine, PC++);
+			Immediate = Read<MapperID>(Machine, PC++);
 			State++;
 			break;
 		case INDIRECT_JUMP +1:
 			STALL;
-			Immediate |= Read(Machine, PC++) << 8;
+			Immediate |= Read<MapperID>(Machine, PC++) << 8;
 			State++;
 			break;
 		case INDIRECT_JUMP +2:
 			STALL;
-			Address = Read(Machine, Immediate);
+			Address = Read<MapperID>(Machine, Immediate);
 			State++;
 			break;
 		case INDIRECT_JUMP +3:
 			STALL;
-			Address |= Read(Machine, (Immediate & 0xFF00) | ((Immediate + 1) & 0x00FF)) << 8;
+			Address |= Read<MapperID>(Machine, (Immediate & 0xFF00) | ((Immediate + 1) & 0x00FF)) << 8;
 			PC = Address;
-			Trace(Machine);
+			Trace<Tracing>(Machine);
 			State = FETCH;
 			break;
 
@@ -1173,7 +1258,7 @@ void StepCPU(machine& Machine)
 
 		case ZERO_PAGE:
 			STALL;
-			Immediate = Read(Machine, PC++);
+			Immediate = Read<MapperID>(Machine, PC++);
 			Address = Immediate;
 			State = Instruction.MemoryOperationState;
 			break;
@@ -1182,12 +1267,12 @@ void StepCPU(machine& Machine)
 
 		case ZERO_PAGE_X:
 			STALL;
-			Immediate = Read(Machine, PC++);
+			Immediate = Read<MapperID>(Machine, PC++);
 			State++;
 			break;
 		case ZERO_PAGE_X +1:
 			STALL;
-			Read(Machine, Immediate);
+			Read<MapperID>(Machine, Immediate);
 			Address = (Immediate + X) & 0xFF;
 			State = Instruction.MemoryOperationState;
 			break;
@@ -1196,12 +1281,12 @@ void StepCPU(machine& Machine)
 
 		case ZERO_PAGE_Y:
 			STALL;
-			Immediate = Read(Machine, PC++);
+			Immediate = Read<MapperID>(Machine, PC++);
 			State++;
 			break;
 		case ZERO_PAGE_Y +1:
 			STALL;
-			Read(Machine, Immediate);
+			Read<MapperID>(Machine, Immediate);
 			Address = (Immediate + Y) & 0xFF;
 			State = Instruction.MemoryOperationState;
 			break;
@@ -1210,12 +1295,12 @@ void StepCPU(machine& Machine)
 
 		case ABSOLUTE:
 			STALL;
-			Immediate = Read(Machine, PC++);
+			Immediate = Read<MapperID>(Machine, PC++);
 			State++;
 			break;
 		case ABSOLUTE +1:
 			STALL;
-			Immediate |= Read(Machine, PC++) << 8;
+			Immediate |= Read<MapperID>(Machine, PC++) << 8;
 			Address = Immediate;
 			State = Instruction.MemoryOperationState;
 			break;
@@ -1224,12 +1309,12 @@ void StepCPU(machine& Machine)
 
 		case ABSOLUTE_X:
 			STALL;
-			Immediate = Read(Machine, PC++);
+			Immediate = Read<MapperID>(Machine, PC++);
 			State++;
 			break;
 		case ABSOLUTE_X +1:
 			STALL;
-			Immediate |= Read(Machine, PC++) << 8;
+			Immediate |= Read<MapperID>(Machine, PC++) << 8;
 			Address = Immediate + X;
 			State++;
 			// If there is no page boundary crossing and we're reading, then we can
@@ -1239,7 +1324,7 @@ void StepCPU(machine& Machine)
 			break;
 		case ABSOLUTE_X +2:
 			STALL;
-			Read(Machine, (Immediate & 0xFF00) | (Address & 0x00FF));
+			Read<MapperID>(Machine, (Immediate & 0xFF00) | (Address & 0x00FF));
 			State = Instruction.MemoryOperationState;
 			break;
 
@@ -1247,12 +1332,12 @@ void StepCPU(machine& Machine)
 
 		case ABSOLUTE_Y:
 			STALL;
-			Immediate = Read(Machine, PC++);
+			Immediate = Read<MapperID>(Machine, PC++);
 			State++;
 			break;
 		case ABSOLUTE_Y +1:
 			STALL;
-			Immediate |= Read(Machine, PC++) << 8;
+			Immediate |= Read<MapperID>(Machine, PC++) << 8;
 			Address = Immediate + Y;
 			State++;
 			// If there is no page boundary crossing and we're reading, then we can
@@ -1262,7 +1347,7 @@ void StepCPU(machine& Machine)
 			break;
 		case ABSOLUTE_Y +2:
 			STALL;
-			Read(Machine, (Immediate & 0xFF00) | (Address & 0x00FF));
+			Read<MapperID>(Machine, (Immediate & 0xFF00) | (Address & 0x00FF));
 			State = Instruction.MemoryOperationState;
 			break;
 
@@ -1270,23 +1355,23 @@ void StepCPU(machine& Machine)
 
 		case INDEXED_INDIRECT:
 			STALL;
-			Immediate = Read(Machine, PC++);
+			Immediate = Read<MapperID>(Machine, PC++);
 			State++;
 			break;
 		case INDEXED_INDIRECT +1:
 			STALL;
-			Read(Machine, Immediate);
+			Read<MapperID>(Machine, Immediate);
 			Indirect = (Immediate + X) & 0xFF;
 			State++;
 			break;
 		case INDEXED_INDIRECT +2:
 			STALL;
-			Address = Read(Machine, Indirect);
+			Address = Read<MapperID>(Machine, Indirect);
 			State++;
 			break;
 		case INDEXED_INDIRECT +3:
 			STALL;
-			Address |= Read(Machine, (Indirect+1) & 0xFF) << 8;
+			Address |= Read<MapperID>(Machine, (Indirect+1) & 0xFF) << 8;
 			State = Instruction.MemoryOperationState;
 			break;
 
@@ -1294,17 +1379,17 @@ void StepCPU(machine& Machine)
 
 		case INDIRECT_INDEXED:
 			STALL;
-			Immediate = Read(Machine, PC++);
+			Immediate = Read<MapperID>(Machine, PC++);
 			State++;
 			break;
 		case INDIRECT_INDEXED +1:
 			STALL;
-			Indirect = Read(Machine, Immediate);
+			Indirect = Read<MapperID>(Machine, Immediate);
 			State++;
 			break;
 		case INDIRECT_INDEXED +2:
 			STALL;
-			Indirect |= Read(Machine, (Immediate+1) & 0xFF) << 8;
+			Indirect |= Read<MapperID>(Machine, (Immediate+1) & 0xFF) << 8;
 			Address = Indirect + Y;
 			State++;
 			// If there is no page boundary crossing and we're reading, then we can
@@ -1314,7 +1399,7 @@ void StepCPU(machine& Machine)
 			break;
 		case INDIRECT_INDEXED +3:
 			STALL;
-			Read(Machine, (Indirect & 0xFF00) | (Address & 0x00FF));
+			Read<MapperID>(Machine, (Indirect & 0xFF00) | (Address & 0x00FF));
 			State = Instruction.MemoryOperationState;
 			break;
 
@@ -1322,9 +1407,9 @@ void StepCPU(machine& Machine)
 
 		case READ:
 			STALL;
-			Operand = Read(Machine, Address);
+			Operand = Read<MapperID>(Machine, Address);
 			Operate(Machine, Instruction.Operation);
-			Trace(Machine);
+			Trace<Tracing>(Machine);
 			State = FETCH;
 			break;
 
@@ -1332,17 +1417,17 @@ void StepCPU(machine& Machine)
 
 		case MODIFY:
 			STALL;
-			Operand = Read(Machine, Address);
+			Operand = Read<MapperID>(Machine, Address);
 			State++;
 			break;
 		case MODIFY +1:
-			Write(Machine, Address, Operand);
+			Write<MapperID>(Machine, Address, Operand);
 			Operate(Machine, Instruction.Operation);
 			State++;
 			break;
 		case MODIFY +2:
-			Write(Machine, Address, Operand);
-			Trace(Machine);
+			Write<MapperID>(Machine, Address, Operand);
+			Trace<Tracing>(Machine);
 			State = FETCH;
 			break;
 
@@ -1350,8 +1435,8 @@ void StepCPU(machine& Machine)
 
 		case WRITE:
 			Operate(Machine, Instruction.Operation);
-			Write(Machine, Address, Operand);
-			Trace(Machine);
+			Write<MapperID>(Machine, Address, Operand);
+			Trace<Tracing>(Machine);
 			State = FETCH;
 			break;
 	}
@@ -1398,4 +1483,16 @@ void StepCPUPhase2(machine& Machine)
 
 	// Update IRQ level detector.
 	CPU.InternalIRQ = CPU.IRQ;
-}
\ No newline at end of file
+}
+
+template void StepCPU<0, false>(machine& Machine);
+template void StepCPU<1, false>(machine& Machine);
+template void StepCPU<2, false>(machine& Machine);
+template void StepCPU<3, false>(machine& Machine);
+template void StepCPU<4, false>(machine& Machine);
+
+template void StepCPU<0, true>(machine& Machine);
+template void StepCPU<1, true>(machine& Machine);
+template void StepCPU<2, true>(machine& Machine);
+template void StepCPU<3, true>(machine& Machine);
+template void StepCPU<4, true>(machine& Machine);
@@ -0,0 +1,223 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "nes.h"
+
+// Episodes reset a machine to a snapshot taken once after booting the game
+// and running a scripted input sequence (e.g. to get past the title screen),
+// so that a reset is a copy instead of a reload and replay.  Snapshots are
+// cached on disk, keyed by the ROM hash, the script and the host settings
+// that affect emulation, as a save state followed by the frame buffer and
+// the index buffer at the snapshot.
+//
+// Resets can be followed by a random number of frames without input, so
+// that episodes do not all start from exactly the same state.
+
+struct episode
+{
+	u32             StateSize;
+	void*           State;                      // Save state at the start of an episode.
+	u32*            FrameBuffer;                // Frame buffer at the start of an episode.
+	u8*             IndexBuffer;                // Index buffer at the start of an episode.
+	u32             MaxNoOpFrameCount;          // Maximum number of no-op frames after a reset.
+	u64             Random;                     // Random number generator state.
+};
+
+static const u32 FrameBufferSize = 256 * 240 * sizeof(u32);
+static const u32 IndexBufferSize = 256 * 240;
+
+// Version of the cache file contents (in addition to the state version).
+static const u32 EpisodeCacheVersion = 2;
+
+static u64 GetScriptHash(const episode_config& Config)
+{
+	u64 Hash = 0xCBF29CE484222325;
+	for (u32 I = 0; I < Config.ScriptLength; I++) {
+		const episode_input& Step = Config.Script[I];
+		Hash = (Hash ^ Step.Input[0]) * 0x100000001B3;
+		Hash = (Hash ^ Step.Input[1]) * 0x100000001B3;
+		Hash = (Hash ^ Step.FrameCount) * 0x100000001B3;
+	}
+	return Hash;
+}
+
+// Disabling audio leaves parts of the APU state as they are, and the video
+// and index outputs decide what the snapshot buffers hold.
+static u64 GetSettingsHash(const machine& Machine)
+{
+	u64 SampleRate;
+	memcpy(&SampleRate, &Machine.AudioSampleRate, sizeof(SampleRate));
+	if (Machine.AudioDisable) SampleRate = 0;
+
+	u64 Hash = 0xCBF29CE484222325;
+	Hash = (Hash ^ Machine.VideoDisable) * 0x100000001B3;
+	Hash = (Hash ^ Machine.AudioDisable) * 0x100000001B3;
+	Hash = (Hash ^ Machine.IndexOutput) * 0x100000001B3;
+	Hash = (Hash ^ SampleRate) * 0x100000001B3;
+	return Hash;
+}
+
+static u32* GetCurrentFrameBuffer(machine& Machine)
+{
+	return Machine.FrameBuffer[Machine.PPU.Frame & 1];
+}
+
+static bool ReadCache(episode* Episode, machine& Machine, const char* Path)
+{
+	FILE* File = fopen(Path, "rb");
+	if (!File) return false;
+
+	bool Valid = fread(Episode->State, 1, Episode->StateSize, File) == Episode->StateSize
+	          && fread(Episode->FrameBuffer, 1, FrameBufferSize, File) == FrameBufferSize
+	          && fread(Episode->IndexBuffer, 1, IndexBufferSize, File) == IndexBufferSize
+	          && LoadState(Machine, Episode->State, Episode->StateSize) == 0;
+
+	fclose(File);
+	return Valid;
+}
+
+// The cache is written to a file of its own and renamed into place, so that
+// other processes creating the same episode never read a partial file.
+static void WriteCache(episode* Episode, const char* Path)
+{
+#ifdef _WIN32
+	int ProcessID = _getpid();
+#else
+	int ProcessID = getpid();
+#endif
+
+	char TempPath[1100];
+	snprintf(TempPath, sizeof(TempPath), "%s.%d-%llx.tmp", Path, ProcessID,
+		(unsigned long long)(uintptr_t)Episode);
+
+	FILE* File = fopen(TempPath, "wb");
+	if (!File) return;
+
+	bool Valid = fwrite(Episode->State, 1, Episode->StateSize, File) == Episode->StateSize
+	          && fwrite(Episode->FrameBuffer, 1, FrameBufferSize, File) == FrameBufferSize
+	          && fwrite(Episode->IndexBuffer, 1, IndexBufferSize, File) == IndexBufferSize;
+	Valid = fclose(File) == 0 && Valid;
+
+	// On Windows, renaming fails if another process wrote the cache first,
+	// and its file is kept.
+	if (!Valid || rename(TempPath, Path) != 0) remove(TempPath);
+}
+
+// Boots the loaded game and runs the script, or loads the resulting
+// snapshot from the cache.  Booting reloads the machine, which stops any
+// trace or movie (host settings are kept).  Leaves the machine at the start
+// of an episode.  Returns null if the machine is not loaded, or fails to
+// reload.
+episode* CreateEpisode(machine& Machine, const episode_config& Config)
+{
+	if (!Machine.IsLoaded) return nullptr;
+
+	episode* Episode = (episode*)calloc(1, sizeof(episode));
+	Episode->StateSize = GetStateSize(Machine);
+	Episode->State = malloc(Episode->StateSize);
+	Episode->FrameBuffer = (u32*)malloc(FrameBufferSize);
+	Episode->IndexBuffer = (u8*)malloc(IndexBufferSize);
+	Episode->MaxNoOpFrameCount = Config.MaxNoOpFrameCount;
+	Episode->Random = Config.Seed ? Config.Seed : 0x9E3779B97F4A7C15;
+
+	char Path[1024] = {};
+	if (Config.CacheDirectory) {
+		snprintf(Path, sizeof(Path), "%s/%016llx-%016llx-%016llx-%u-%u.episode", Config.CacheDirectory,
+			(unsigned long long)Machine.ROMHash, (unsigned long long)GetScriptHash(Config),
+			(unsigned long long)GetSettingsHash(Machine), StateVersion, EpisodeCacheVersion);
+	}
+
+	if (!Path[0] || !ReadCache(Episode, Machine, Path)) {
+		// Power on, keeping the host settings.
+		input_poll InputPoll = Machine.InputPoll;
+		void* InputContext = Machine.InputContext;
+		bool VideoDisable = Machine.VideoDisable;
+		bool AudioDisable = Machine.AudioDisable;
+		bool IndexOutput = Machine.IndexOutput;
+		f64 AudioSampleRate = Machine.AudioSampleRate;
+
+		if (Load(Machine, Machine.ROM) < 0) {
+			DestroyEpisode(Episode);
+			return nullptr;
+		}
+
+		Machine.VideoDisable = VideoDisable;
+		Machine.AudioDisable = AudioDisable;
+		Machine.IndexOutput = IndexOutput;
+		Machine.AudioSampleRate = AudioSampleRate;
+
+		for (u32 I = 0; I < Config.ScriptLength; I++) {
+			const episode_input& Step = Config.Script[I];
+			Machine.Input[0] = Step.Input[0];
+			Machine.Input[1] = Step.Input[1];
+			for (u32 K = 0; K < Step.FrameCount; K++) {
+				RunUntilVerticalBlank(Machine);
+				Machine.AudioPointer = 0;
+			}
+		}
+
+		Machine.InputPoll = InputPoll;
+		Machine.InputContext = InputContext;
+
+		SaveState(Machine, Episode->State, Episode->StateSize);
+		memcpy(Episode->FrameBuffer, GetCurrentFrameBuffer(Machine), FrameBufferSize);
+		memcpy(Episode->IndexBuffer, Machine.IndexBuffer, IndexBufferSize);
+
+		if (Path[0]) WriteCache(Episode, Path);
+	}
+
+	ResetEpisode(Episode, Machine);
+
+	return Episode;
+}
+
+void DestroyEpisode(episode* Episode)
+{
+	if (!Episode) return;
+	free(Episode->State);
+	free(Episode->FrameBuffer);
+	free(Episode->IndexBuffer);
+	free(Episode);
+}
+
+// Restores the machine to the start of an episode, and then runs
+// a random number of frames (up to MaxNoOpFrameCount) without input.
+// Returns the number of no-op frames run.
+u32 ResetEpisode(episode* Episode, machine& Machine)
+{
+	LoadState(Machine, Episode->State, Episode->StateSize);
+	memcpy(GetCurrentFrameBuffer(Machine), Episode->FrameBuffer, FrameBufferSize);
+	memcpy(Machine.IndexBuffer, Episode->IndexBuffer, IndexBufferSize);
+	Machine.AudioPointer = 0;
+
+	if (Episode->MaxNoOpFrameCount == 0) return 0;
+
+	// Xorshift64*.
+	u64 X = Episode->Random;
+	X ^= X >> 12;
+	X ^= X << 25;
+	X ^= X >> 27;
+	Episode->Random = X;
+	u32 NoOpFrameCount = u32(((X * 0x2545F4914F6CDD1D) >> 32) % (Episode->MaxNoOpFrameCount + 1));
+
+	input_poll InputPoll = Machine.InputPoll;
+	Machine.InputPoll = nullptr;
+	Machine.Input[0] = 0;
+	Machine.Input[1] = 0;
+	for (u32 I = 0; I < NoOpFrameCount; I++) {
+		RunUntilVerticalBlank(Machine);
+		Machine.AudioPointer = 0;
+	}
+	Machine.InputPoll = InputPoll;
+
+	return NoOpFrameCount;
+}
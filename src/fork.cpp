@@ -0,0 +1,148 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+#include "nes.h"
+
+// Forks capture the state of a machine as a node in a tree of states, for
+// search over many branches from a common state.  The memory of the machine
+// (RAM, CIRAM, PRG RAM and CHR RAM) is stored in pages, and a fork shares
+// the pages that are unchanged from its base (normally the fork it was
+// restored from) with it.  Each fork then only holds copies of the pages
+// written since the base, so that a large tree of forks takes little more
+// memory than the data that actually differs between them.
+//
+// The machine itself keeps its memory in flat arrays, so that the bus paths
+// do not pay for any indirection.  Restoring a fork copies all of its
+// pages into the machine.
+//
+// Forking and restoring start a new write generation of the machine.  When
+// the machine is then forked again with the same fork as the base, the pages
+// not written since are shared without comparing them.
+//
+// Fork identifiers are unique across threads, but forks are not otherwise
+// thread-safe; a tree of forks should be used by one thread.
+
+// The memory arrays are contiguous at the end of the machine state,
+// in the order the memory pages are numbered in.
+constexpr u32 ForkHeadSize = offsetof(machine_state, RAM);
+constexpr u32 ForkMemorySize = MemoryPageCount * MemoryPageSize;
+
+static_assert(offsetof(machine_state, CIRAM)  == ForkHeadSize + CIRAMPageBase  * MemoryPageSize);
+static_assert(offsetof(machine_state, PRGRAM) == ForkHeadSize + PRGRAMPageBase * MemoryPageSize);
+static_assert(offsetof(machine_state, CHRRAM) == ForkHeadSize + CHRRAMPageBase * MemoryPageSize);
+static_assert(offsetof(machine_state, CHRRAM) + sizeof(machine_state::CHRRAM) == ForkHeadSize + ForkMemorySize);
+static_assert(sizeof(machine_state) - ForkHeadSize - ForkMemorySize < alignof(machine_state));
+
+struct fork_page
+{
+	u32             RefCount;                   // Number of forks sharing the page.
+	u8              Data[MemoryPageSize];
+};
+
+static std::atomic<u64> LastForkID;
+
+struct fork_node
+{
+	u32             RefCount;                   // Number of references to the fork.
+	u64             ID;                         // Unique identifier (see machine::ForkID).
+	u64             ROMHash;                    // Hash of the ROM the state belongs to.
+	u8              Head[ForkHeadSize];         // Machine state up to the memory arrays.
+	fork_page*      Pages[MemoryPageCount];       // Memory pages (possibly shared).
+};
+
+static u8* GetMemory(machine& Machine)
+{
+	return (u8*)(machine_state*)&Machine + ForkHeadSize;
+}
+
+// Creates a fork holding the current state of the machine.  Pages equal to
+// the corresponding pages of the base fork (optional) are shared with it.
+fork_node* Fork(machine& Machine, const fork_node* Base)
+{
+	if (Base && Base->ROMHash != Machine.ROMHash) Base = nullptr;
+
+	// If the machine was forked from or restored to the base, the pages
+	// not written since are known to be equal.
+	bool Tracked = Base && Machine.ForkID == Base->ID;
+
+	fork_node* Node = (fork_node*)malloc(sizeof(fork_node));
+	Node->RefCount = 1;
+	Node->ID = LastForkID.fetch_add(1, std::memory_order_relaxed) + 1;
+	Node->ROMHash = Machine.ROMHash;
+	memcpy(Node->Head, (const machine_state*)&Machine, ForkHeadSize);
+
+	const u8* Memory = GetMemory(Machine);
+
+	for (u32 I = 0; I < MemoryPageCount; I++) {
+		const u8* Data = Memory + I * MemoryPageSize;
+
+		bool Dirty = Machine.PageGenerations[I] >= Machine.ForkGeneration;
+
+		if (Base && ((Tracked && !Dirty) || memcmp(Base->Pages[I]->Data, Data, MemoryPageSize) == 0)) {
+			fork_page* Page = Base->Pages[I];
+			Page->RefCount += 1;
+			Node->Pages[I] = Page;
+			continue;
+		}
+
+		fork_page* Page = (fork_page*)malloc(sizeof(fork_page));
+		Page->RefCount = 1;
+		memcpy(Page->Data, Data, MemoryPageSize);
+		Node->Pages[I] = Page;
+	}
+
+	Machine.ForkID = Node->ID;
+	Machine.ForkGeneration = NewWriteGeneration(Machine);
+
+	return Node;
+}
+
+// Returns 0 on success, or -1 if the fork belongs to a different ROM.
+i32 RestoreFork(machine& Machine, const fork_node* Node)
+{
+	if (!Machine.IsLoaded || Node->ROMHash != Machine.ROMHash) return -1;
+
+	memcpy((machine_state*)&Machine, Node->Head, ForkHeadSize);
+
+	u8* Memory = GetMemory(Machine);
+	for (u32 I = 0; I < MemoryPageCount; I++)
+		memcpy(Memory + I * MemoryPageSize, Node->Pages[I]->Data, MemoryPageSize);
+
+	// The memory was written other than through the bus.
+	MarkAllPagesDirty(Machine);
+
+	Machine.ForkID = Node->ID;
+	Machine.ForkGeneration = NewWriteGeneration(Machine);
+
+	return 0;
+}
+
+fork_node* RetainFork(fork_node* Node)
+{
+	Node->RefCount += 1;
+	return Node;
+}
+
+void ReleaseFork(fork_node* Node)
+{
+	if (!Node || --Node->RefCount > 0) return;
+
+	for (u32 I = 0; I < MemoryPageCount; I++) {
+		fork_page* Page = Node->Pages[I];
+		if (--Page->RefCount == 0) free(Page);
+	}
+
+	free(Node);
+}
+
+// Returns the memory held by the fork, counting shared pages
+// in proportion to the number of forks sharing them.
+f64 GetForkMemorySize(const fork_node* Node)
+{
+	f64 Size = sizeof(fork_node);
+	for (u32 I = 0; I < MemoryPageCount; I++)
+		Size += f64(sizeof(fork_page)) / Node->Pages[I]->RefCount;
+	return Size;
+}
@@ -0,0 +1,194 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bit>
+
+#include "nes.h"
+
+// State hashes identify machine states for exploration, e.g. to tell if
+// a state has been seen before.  A hash covers the memory arrays selected by
+// the flags, page by page, and optionally the parts of the PPU state that
+// affect the picture.  They are 128-bit, so that collisions are negligible
+// even between billions of states, but are not cryptographic.
+//
+// Each memory page is hashed separately (seeded with its page number), and
+// the page hashes are combined with exclusive or.  A state hasher keeps the
+// hashes of the pages, and on each update only hashes the pages written
+// since the previous update, according to the write generations of the
+// machine (see NewWriteGeneration).  When updated with a different machine
+// than the previous time, every page is hashed again.
+//
+// Memory written other than through the bus (e.g. directly to Machine.RAM)
+// is not tracked; call MarkAllPagesDirty after such writes.
+
+struct state_hasher
+{
+	u32             Flags;                      // State hash flags.
+	u64             PageMask[2];                // Pages included in the hash.
+	const machine*  Machine;                    // Machine of the last update (null if none).
+	u64             Generation;                 // Write generation started at the last update.
+	state_hash      Pages[MemoryPageCount];     // Hash of each included page.
+	state_hash      Memory;                     // Combined hash of the included pages.
+};
+
+static const u64 Prime1 = 0x9E3779B185EBCA87;
+static const u64 Prime2 = 0xC2B2AE3D27D4EB4F;
+static const u64 Prime3 = 0x165667B19E3779F9;
+static const u64 Prime4 = 0x85EBCA77C2B2AE63;
+
+static inline u64 RotateLeft(u64 X, u32 N)
+{
+	return (X << N) | (X >> (64 - N));
+}
+
+static inline u64 Round(u64 Accumulator, u64 Word)
+{
+	return RotateLeft(Accumulator + Word * Prime2, 31) * Prime1;
+}
+
+static inline u64 Avalanche(u64 X)
+{
+	X ^= X >> 33;
+	X *= Prime2;
+	X ^= X >> 29;
+	X *= Prime3;
+	X ^= X >> 32;
+	return X;
+}
+
+// Hashes a block of data (a multiple of 32 bytes in size) in four
+// independent lanes, in the manner of xxHash64.
+static state_hash HashBlock(const u8* Data, u32 Size, u64 Seed)
+{
+	u64 A = Seed + Prime1 + Prime2;
+	u64 B = Seed + Prime2;
+	u64 C = Seed;
+	u64 D = Seed - Prime1;
+
+	for (u32 I = 0; I < Size; I += 32) {
+		u64 Words[4];
+		memcpy(Words, Data + I, 32);
+		A = Round(A, Words[0]);
+		B = Round(B, Words[1]);
+		C = Round(C, Words[2]);
+		D = Round(D, Words[3]);
+	}
+
+	state_hash Hash;
+	Hash.Low = Avalanche(RotateLeft(A, 1) + RotateLeft(B, 7) + RotateLeft(C, 12) + RotateLeft(D, 18));
+	Hash.High = Avalanche((A ^ RotateLeft(C, 29)) * Prime4 + (B ^ RotateLeft(D, 43)) + Seed);
+	return Hash;
+}
+
+static_assert(MemoryPageSize % 32 == 0);
+
+// The memory arrays are contiguous, in the order the pages are numbered in
+// (see fork.cpp).
+static const u8* GetMemory(const machine& Machine)
+{
+	return (const u8*)(const machine_state*)&Machine + offsetof(machine_state, RAM);
+}
+
+static state_hash HashPage(const machine& Machine, u32 Page)
+{
+	return HashBlock(GetMemory(Machine) + Page * MemoryPageSize, MemoryPageSize, Page);
+}
+
+static void GetPageMask(u32 Flags, u64* Mask)
+{
+	Mask[0] = 0;
+	Mask[1] = 0;
+
+	auto AddPages = [Mask](u32 First, u32 End) {
+		for (u32 Page = First; Page < End; Page++)
+			Mask[Page >> 6] |= 1ull << (Page & 63);
+	};
+
+	if (Flags & StateHashRAM)    AddPages(RAMPageBase, CIRAMPageBase);
+	if (Flags & StateHashCIRAM)  AddPages(CIRAMPageBase, PRGRAMPageBase);
+	if (Flags & StateHashPRGRAM) AddPages(PRGRAMPageBase, CHRRAMPageBase);
+	if (Flags & StateHashCHRRAM) AddPages(CHRRAMPageBase, MemoryPageCount);
+}
+
+// Adds the hash of the PPU state (if selected) to the memory hash.
+static state_hash Finish(const machine& Machine, u32 Flags, state_hash Hash)
+{
+	if (Flags & StateHashPPU) {
+		const ppu& PPU = Machine.PPU;
+
+		u8 Data[320] = {};
+		memcpy(Data, &PPU.V, sizeof(PPU.V));
+		memcpy(Data + 2, &PPU.T, sizeof(PPU.T));
+		Data[4] = PPU.X;
+		memcpy(Data + 32, PPU.Palette, sizeof(PPU.Palette));
+		memcpy(Data + 64, PPU.SpriteOAM, sizeof(PPU.SpriteOAM));
+
+		state_hash PPUHash = HashBlock(Data, sizeof(Data), MemoryPageCount);
+		Hash.Low ^= PPUHash.Low;
+		Hash.High ^= PPUHash.High;
+	}
+
+	return Hash;
+}
+
+// Hashes the selected state of the machine from scratch.
+state_hash HashState(const machine& Machine, u32 Flags)
+{
+	u64 Mask[2];
+	GetPageMask(Flags, Mask);
+
+	state_hash Hash = {};
+	for (u32 Page = 0; Page < MemoryPageCount; Page++) {
+		if (!((Mask[Page >> 6] >> (Page & 63)) & 1)) continue;
+		state_hash PageHash = HashPage(Machine, Page);
+		Hash.Low ^= PageHash.Low;
+		Hash.High ^= PageHash.High;
+	}
+
+	return Finish(Machine, Flags, Hash);
+}
+
+state_hasher* CreateStateHasher(u32 Flags)
+{
+	state_hasher* Hasher = (state_hasher*)calloc(1, sizeof(state_hasher));
+	Hasher->Flags = Flags;
+	GetPageMask(Flags, Hasher->PageMask);
+	return Hasher;
+}
+
+void DestroyStateHasher(state_hasher* Hasher)
+{
+	free(Hasher);
+}
+
+// Returns the hash of the selected state of the machine, hashing only the
+// pages written since the previous update of the machine with this hasher.
+// The result is the same as from HashState.
+state_hash UpdateStateHash(state_hasher* Hasher, machine& Machine)
+{
+	u64 Dirty[2] = { Hasher->PageMask[0], Hasher->PageMask[1] };
+	if (Hasher->Machine == &Machine) {
+		u64 Written[2];
+		GetDirtyPages(Machine, Hasher->Generation, Written);
+		Dirty[0] &= Written[0];
+		Dirty[1] &= Written[1];
+	}
+
+	for (u32 Word = 0; Word < 2; Word++) {
+		while (Dirty[Word]) {
+			u32 Page = Word * 64 + u32(std::countr_zero(Dirty[Word]));
+			Dirty[Word] &= Dirty[Word] - 1;
+
+			state_hash& PageHash = Hasher->Pages[Page];
+			state_hash NewHash = HashPage(Machine, Page);
+			Hasher->Memory.Low ^= PageHash.Low ^ NewHash.Low;
+			Hasher->Memory.High ^= PageHash.High ^ NewHash.High;
+			PageHash = NewHash;
+		}
+	}
+
+	Hasher->Machine = &Machine;
+	Hasher->Generation = NewWriteGeneration(Machine);
+
+	return Finish(Machine, Hasher->Flags, Hasher->Memory);
+}
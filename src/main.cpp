@@ -6,6 +6,13 @@
 #include <memory.h>
 #include <math.h>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
 #define SDL_MAIN_HANDLED
 #include <SDL.h>
 
@@ -22,6 +29,154 @@ struct tas_frame
 	u8      Buttons[2];
 };
 
+// Frame delay: instead of emulating a frame right after presenting the
+// previous one, wait until just enough time is left to emulate the frame
+// before its presentation deadline.  The input is then sampled as late as
+// possible.  The wait is tuned from the measured emulation time, plus a
+// safety margin that grows when a deadline is missed.
+struct frame_delay
+{
+	bool            Enable;
+	f64             EmulationTime;              // Estimated (peak) frame emulation time.
+	f64             Margin;                     // Safety margin.
+	f64             Delay;                      // Wait after the previous deadline, before sampling input.
+	f64             Latency;                    // Average time from sampling input to presenting.
+	u64             FrameCount;                 // Frames presented.
+	u64             MissCount;                  // Frames presented after their deadline.
+	u32             FramesSinceMiss;
+};
+
+const f64 FramePeriod = 1.0 / 60.0;
+
+static f64 GetTime()
+{
+	return f64(SDL_GetPerformanceCounter()) / f64(SDL_GetPerformanceFrequency());
+}
+
+// Frame pacing.  Waits sleep until shortly before the target time, then
+// spin for the rest, to be precise without burning a core.  The spin time
+// adapts to how much the sleeps overshoot.
+enum pacing_mode
+{
+	PaceTimer,                                  // Pace by the system clock.
+	PaceAudio,                                  // Pace by the audio device clock (keep the queue level).
+};
+
+const i32 JitterBucketCount = 34;              // 0.25 ms buckets from -4 ms to +4 ms, plus outliers.
+
+struct frame_pacer
+{
+	pacing_mode     Mode;
+	f64             SpinTime;                   // Busy-wait this long at the end of each wait.
+	f64             PreviousPresentTime;
+	u64             Jitter[JitterBucketCount];  // Histogram of frame time deviation from FramePeriod.
+};
+
+static void Sleep(f64 Seconds)
+{
+#ifdef _WIN32
+	static HANDLE Timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	if (Timer) {
+		LARGE_INTEGER DueTime;
+		DueTime.QuadPart = -i64(Seconds * 1e7);
+		SetWaitableTimer(Timer, &DueTime, 0, nullptr, nullptr, FALSE);
+		WaitForSingleObject(Timer, INFINITE);
+	}
+	else {
+		::Sleep(DWORD(Seconds * 1000.0));
+	}
+#else
+	timespec Duration;
+	Duration.tv_sec = time_t(Seconds);
+	Duration.tv_nsec = long((Seconds - f64(Duration.tv_sec)) * 1e9);
+	nanosleep(&Duration, nullptr);
+#endif
+}
+
+static void WaitUntil(frame_pacer& Pacer, f64 Time)
+{
+	f64 WakeTime = Time - Pacer.SpinTime;
+
+	if (GetTime() < WakeTime) {
+		Sleep(WakeTime - GetTime());
+
+		// Keep the spin time just above the (slowly decaying) peak overshoot.
+		f64 Overshoot = GetTime() - WakeTime + 0.0002;
+		if (Overshoot > Pacer.SpinTime)
+			Pacer.SpinTime = Overshoot < 0.004 ? Overshoot : 0.004;
+		else
+			Pacer.SpinTime = 0.999 * Pacer.SpinTime + 0.001 * Overshoot;
+	}
+
+	while (GetTime() < Time);
+}
+
+static void UpdateFramePacer(frame_pacer& Pacer, f64 PresentTime)
+{
+	if (Pacer.PreviousPresentTime > 0.0) {
+		f64 Deviation = PresentTime - Pacer.PreviousPresentTime - FramePeriod;
+		i32 Bucket = i32(floor(Deviation / 0.00025)) + JitterBucketCount / 2;
+		if (Bucket < 0) Bucket = 0;
+		if (Bucket > JitterBucketCount - 1) Bucket = JitterBucketCount - 1;
+		Pacer.Jitter[Bucket] += 1;
+	}
+	Pacer.PreviousPresentTime = PresentTime;
+}
+
+static void PrintJitterHistogram(frame_pacer& Pacer)
+{
+	u64 Total = 0;
+	for (i32 I = 0; I < JitterBucketCount; I++)
+		Total += Pacer.Jitter[I];
+	if (Total == 0) return;
+
+	printf("Frame time deviation from %.2f ms:\n", FramePeriod * 1000.0);
+	for (i32 I = 0; I < JitterBucketCount; I++) {
+		if (I == 0)
+			printf("       < -4.00 ms");
+		else if (I == JitterBucketCount - 1)
+			printf("      >= +4.00 ms");
+		else
+			printf("  %+5.2f..%+5.2f ms", (I - JitterBucketCount / 2) * 0.25, (I - JitterBucketCount / 2 + 1) * 0.25);
+		printf(" %8llu %5.1f%%\n", (unsigned long long)Pacer.Jitter[I], 100.0 * Pacer.Jitter[I] / Total);
+	}
+}
+
+// Returns the time to sample input and start emulating the frame.
+static f64 GetFrameStartTime(frame_delay& FD, f64 Deadline)
+{
+	FD.Delay = 0.0;
+	if (FD.Enable) {
+		FD.Delay = FramePeriod - FD.EmulationTime - FD.Margin;
+		if (FD.Delay < 0.0) FD.Delay = 0.0;
+	}
+	return Deadline - FramePeriod + FD.Delay;
+}
+
+static void UpdateFrameDelay(frame_delay& FD, f64 Deadline, f64 InputTime, f64 EmulatedTime, f64 PresentTime)
+{
+	// Track the peak emulation time, decaying slowly.
+	f64 EmulationTime = EmulatedTime - InputTime;
+	if (EmulationTime > FD.EmulationTime)
+		FD.EmulationTime = EmulationTime;
+	else
+		FD.EmulationTime = 0.98 * FD.EmulationTime + 0.02 * EmulationTime;
+
+	FD.Latency = 0.95 * FD.Latency + 0.05 * (PresentTime - InputTime);
+	FD.FrameCount += 1;
+
+	// Double the margin on a miss, shrink it slowly otherwise.
+	if (PresentTime > Deadline) {
+		FD.MissCount += 1;
+		FD.FramesSinceMiss = 0;
+		FD.Margin = FD.Margin * 2.0 < FramePeriod ? FD.Margin * 2.0 : FramePeriod;
+	}
+	else if (++FD.FramesSinceMiss >= 60) {
+		FD.FramesSinceMiss = 0;
+		FD.Margin = FD.Margin * 0.9 > 0.0005 ? FD.Margin * 0.9 : 0.0005;
+	}
+}
+
 static bool OpenFileDialog(nfdu8char_t** Path)
 {
 };
@@ -66,6 +221,99 @@ i32 ReadTASFile(const char* Path, tas_frame** OutFrameData, i32* OutFrameCount)
 	return 0;
 }
 
+// Input provider, called by the emulator when the game latches the
+// controllers.  Pumps events first, to read the freshest keyboard state.
+static void PollKeyboard(machine& M, void*)
+{
+	SDL_PumpEvents();
+
+	const u8* Keys = SDL_GetKeyboardState(nullptr);
+	M.Input[0] = 0x00;
+	if (Keys[SDL_SCANCODE_A]     ) M.Input[0] |= ButtonB;
+	if (Keys[SDL_SCANCODE_S]     ) M.Input[0] |= ButtonA;
+	if (Keys[SDL_SCANCODE_RETURN]) M.Input[0] |= ButtonStart;
+	if (Keys[SDL_SCANCODE_SPACE] ) M.Input[0] |= ButtonSelect;
+	if (Keys[SDL_SCANCODE_UP]    ) M.Input[0] |= ButtonUp;
+	if (Keys[SDL_SCANCODE_DOWN]  ) M.Input[0] |= ButtonDown;
+	if (Keys[SDL_SCANCODE_LEFT]  ) M.Input[0] |= ButtonLeft;
+	if (Keys[SDL_SCANCODE_RIGHT] ) M.Input[0] |= ButtonRight;
+}
+
+// Emulates a frame, then runs ahead the given number of frames, keeping
+// the last one for display, and restores the state.  The displayed frame
+// then reflects the current input that many frames earlier.  Returns the
+// frame buffer to display.
+static u32* RunFrameAhead(machine& M, i32 RunAheadFrames, void* State, u32 StateSize)
+{
+	if (RunAheadFrames == 0) {
+		RunUntilVerticalBlank(M);
+		return M.FrameBuffer[M.PPU.Frame & 1];
+	}
+
+	M.VideoDisable = true;
+	RunUntilVerticalBlank(M);
+
+	SaveState(M, State, StateSize);
+
+	// Input latched in the frames run ahead is not part of a movie.
+	movie* Movie = M.Movie;
+	M.Movie = nullptr;
+
+	M.AudioDisable = true;
+	for (i32 I = 1; I <= RunAheadFrames; I++) {
+		M.VideoDisable = I < RunAheadFrames;
+		RunUntilVerticalBlank(M);
+	}
+	u32* FrameBuffer = M.FrameBuffer[M.PPU.Frame & 1];
+
+	LoadState(M, State, StateSize);
+	M.AudioDisable = false;
+	M.VideoDisable = false;
+	M.Movie = Movie;
+
+	return FrameBuffer;
+}
+
+// Fast-forward speed multipliers (0 = uncapped).
+const i32 FastForwardSpeedTable[] = { 2, 4, 8, 0 };
+
+// Emulates several frames, of which only the last one is presented.  The
+// others run without video and audio output; the audio of the last frame
+// is kept, so the sound is choppy but at the correct pitch.  With speed 0,
+// emulates as many frames as fit before the deadline.  Returns the frame
+// buffer to display.
+static u32* RunFastForward(machine& M, i32 Speed, f64 Deadline, i32* FrameCount)
+{
+	f64 FrameTime = 0.0;
+	i32 Count = 0;
+
+	M.VideoDisable = true;
+	M.AudioDisable = true;
+
+	for (;;) {
+		f64 StartTime = GetTime();
+
+		bool IsLast = Speed > 0
+			? Count == Speed - 1
+			: StartTime + 2.0 * FrameTime >= Deadline;
+
+		if (IsLast) {
+			M.VideoDisable = false;
+			M.AudioDisable = false;
+		}
+
+		RunUntilVerticalBlank(M);
+		Count += 1;
+
+		FrameTime = GetTime() - StartTime;
+
+		if (IsLast) break;
+	}
+
+	*FrameCount = Count;
+	return M.FrameBuffer[M.PPU.Frame & 1];
+}
+
 int main(int argc, char* args[])
 {
 	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
@@ -96,9 +344,33 @@ int main(int argc, char* args[])
 	machine M;
 	memset(&M, 0, sizeof(machine));
 
+	// Keep up to 10 minutes of rewind history, within 64 MB.
+	rewind_buffer* Rewind = CreateRewindBuffer(64 << 20, 10 * 60 * 60);
+
+	i32 RunAheadFrames = 0;
+	u32 RunAheadStateSize = GetStateSize(M);
+	void* RunAheadState = malloc(RunAheadStateSize);
+
+	u32* FrameBuffer = nullptr;
+
+	bool FastForward = false;
+	i32 FastForwardSpeedIndex = 0;
+	u64 EmulatedFrameCount = 0;
+
 	u64 CurrentFrame = 0;
-	u64 PreviousTime = SDL_GetTicks64();
-	double TimeToNextFrame = 0.0;
+
+	frame_delay FrameDelay = {};
+	FrameDelay.Enable = true;
+	FrameDelay.Margin = 0.002;
+
+	frame_pacer Pacer = {};
+	Pacer.Mode = PaceTimer;
+	Pacer.SpinTime = 0.001;
+
+	f64 Deadline = GetTime() + FramePeriod;
+	f64 StatsTime = 0.0;
+
+	char Title[1024] = "NES Emulator";
 
 	f64 QueuedAudioSize = 0.0;
 
@@ -107,6 +379,7 @@ int main(int argc, char* args[])
 	bool FrameSteppingMode = false;
 
 	while (!Exit) {
+		WaitUntil(Pacer, GetFrameStartTime(FrameDelay, Deadline));
 
 		SDL_Event Event;
 		while (SDL_PollEvent(&Event)) {
@@ -120,32 +393,97 @@ int main(int argc, char* args[])
 				nfdu8char_t* Path = nullptr;
 				if (NFD_OpenDialogU8(&Path, &Filter, 1, nullptr) == NFD_OKAY) {
 					i64 Result = Load(M, Path);
+					ClearRewindBuffer(Rewind);
+					FrameBuffer = M.FrameBuffer[0];
+					M.InputPoll = PollKeyboard;
 
-					if (Result >= 0) {
-						char Title[1024];
-						snprintf(Title, 1024, "NES Emulator - %s (Mapper %d)\n", Path, M.Mapper.ID);
-						SDL_SetWindowTitle(Window, Title);
-					}
-					else {
-						SDL_SetWindowTitle(Window, "NES Emulator");
-					}
+					if (Result >= 0)
+						snprintf(Title, 1024, "NES Emulator - %s (Mapper %d)", Path, M.Mapper.ID);
+					else
+						snprintf(Title, 1024, "NES Emulator");
+					SDL_SetWindowTitle(Window, Title);
 
 					CurrentFrame = 0;
 					NFD_FreePathU8(Path);
 				}
 			}
-			// T: Open/close debug trace file.
+			// T: Open/close debug trace file (use tracefmt to convert it to text).
 			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_T) {
 				if (M.TraceFile) {
 					printf("Closing trace file\n");
-					fclose(M.TraceFile);
-					M.TraceFile = nullptr;
-					M.TraceLine = 0;
+					CloseTrace(M);
 				}
 				else {
 					printf("Opening trace file\n");
-					M.TraceFile = fopen("trace.txt", "wb");
-					M.TraceLine = 0;
+					OpenTrace(M, "trace.bin");
+				}
+			}
+			// C: Start/stop capturing recent instructions in memory.
+			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_C) {
+				if (M.TraceEnable) {
+					printf("Stopping trace capture\n");
+					CloseTrace(M);
+				}
+				else {
+					printf("Starting trace capture\n");
+					OpenTrace(M, nullptr);
+				}
+			}
+			// D: Dump captured instructions to a text file.
+			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_D) {
+				FILE* File = fopen("trace_dump.txt", "wt");
+				if (File) {
+					u32 Count = DumpTrace(M, File, TraceDefaultBufferSize);
+					printf("Dumped %u trace records\n", Count);
+					fclose(File);
+				}
+			}
+			// F5: Save state to a file.
+			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_F5 && M.IsLoaded) {
+				u32 Size = GetStateSize(M);
+				void* State = malloc(Size);
+				FILE* File = fopen("quicksave.state", "wb");
+				if (File && SaveState(M, State, Size) > 0) {
+					fwrite(State, 1, Size, File);
+					printf("Saved state\n");
+				}
+				if (File) fclose(File);
+				free(State);
+			}
+			// F7: Load state from a file.
+			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_F7 && M.IsLoaded) {
+				u32 Size = GetStateSize(M);
+				void* State = malloc(Size);
+				FILE* File = fopen("quicksave.state", "rb");
+				StopMovie(M);
+				if (File && fread(State, 1, Size, File) == Size && LoadState(M, State, Size) == 0)
+					printf("Loaded state\n");
+				else
+					printf("Failed to load state\n");
+				if (File) fclose(File);
+				free(State);
+			}
+			// F9: Start/stop recording a movie.
+			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_F9 && M.IsLoaded) {
+				if (M.Movie) {
+					printf("Stopped movie\n");
+					StopMovie(M);
+				}
+				else if (RecordMovie(M, "movie.bin") == 0) {
+					printf("Recording movie\n");
+				}
+			}
+			// F10: Start/stop playing back a movie.
+			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_F10 && M.IsLoaded) {
+				if (M.Movie) {
+					printf("Stopped movie\n");
+					StopMovie(M);
+				}
+				else if (PlayMovie(M, "movie.bin") == 0) {
+					printf("Playing back movie\n");
+				}
+				else {
+					printf("Failed to play back movie\n");
 				}
 			}
 			// P: Pause emulator.
@@ -157,6 +495,38 @@ int main(int argc, char* args[])
 				FrameSteppingMode = true;
 				Paused = false;
 			}
+			// R: Cycle the number of run-ahead frames (0-2).
+			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_R) {
+				RunAheadFrames = (RunAheadFrames + 1) % 3;
+				printf("Run-ahead: %d frames\n", RunAheadFrames);
+			}
+			// L: Toggle frame delay.
+			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_L) {
+				FrameDelay.Enable = !FrameDelay.Enable;
+				printf("Frame delay: %s\n", FrameDelay.Enable ? "on" : "off");
+			}
+			// K: Toggle pacing by the audio device clock.
+			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_K) {
+				Pacer.Mode = Pacer.Mode == PaceTimer ? PaceAudio : PaceTimer;
+				printf("Pacing: %s clock\n", Pacer.Mode == PaceAudio ? "audio" : "system");
+			}
+			// J: Print frame time jitter histogram.
+			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_J) {
+				PrintJitterHistogram(Pacer);
+			}
+			// Tab: Toggle fast-forward.
+			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_TAB) {
+				FastForward = !FastForward;
+			}
+			// M: Cycle the fast-forward speed.
+			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_M) {
+				FastForwardSpeedIndex = (FastForwardSpeedIndex + 1) % 4;
+				i32 Speed = FastForwardSpeedTable[FastForwardSpeedIndex];
+				if (Speed > 0)
+					printf("Fast-forward speed: %dx\n", Speed);
+				else
+					printf("Fast-forward speed: uncapped\n");
+			}
 			// G: Cancel frame-stepping.
 			if (Event.type == SDL_KEYDOWN && Event.key.keysym.scancode == SDL_SCANCODE_G) {
 				FrameSteppingMode = false;
@@ -166,39 +536,70 @@ int main(int argc, char* args[])
 
 		if (Exit) break;
 
-		if (!M.IsLoaded) continue;
+		if (!M.IsLoaded) {
+			Deadline = GetTime() + FramePeriod;
+			Pacer.PreviousPresentTime = 0.0;
+			continue;
+		}
+
+		f64 InputTime = GetTime();
 
 		if (!Paused) {
+			// The controller input is read by PollKeyboard when the game
+			// latches it, so it is as fresh as possible.
 			const u8* Keys = SDL_GetKeyboardState(nullptr);
-			M.Input[0] = 0x00;
-			if (Keys[SDL_SCANCODE_A]     ) M.Input[0] |= ButtonB;
-			if (Keys[SDL_SCANCODE_S]     ) M.Input[0] |= ButtonA;
-			if (Keys[SDL_SCANCODE_RETURN]) M.Input[0] |= ButtonStart;
-			if (Keys[SDL_SCANCODE_SPACE] ) M.Input[0] |= ButtonSelect;
-			if (Keys[SDL_SCANCODE_UP]    ) M.Input[0] |= ButtonUp;
-			if (Keys[SDL_SCANCODE_DOWN]  ) M.Input[0] |= ButtonDown;
-			if (Keys[SDL_SCANCODE_LEFT]  ) M.Input[0] |= ButtonLeft;
-			if (Keys[SDL_SCANCODE_RIGHT] ) M.Input[0] |= ButtonRight;
-
-			RunUntilVerticalBlank(M);
+
+			// Backspace: Rewind.  Restore the most recent state in the history
+			// and run the frame after it again (silently) to display it.
+			// A movie being recorded or played back ends here.
+			if (Keys[SDL_SCANCODE_BACKSPACE]) {
+				StopMovie(M);
+				if (PopRewindFrame(Rewind, M) == 0) {
+					RunUntilVerticalBlank(M);
+					FrameBuffer = M.FrameBuffer[M.PPU.Frame & 1];
+					M.AudioPointer = 0;
+				}
+			}
+			// Only the presented frames are recorded for rewinding.
+			else if (FastForward) {
+				i32 Count;
+				FrameBuffer = RunFastForward(M, FastForwardSpeedTable[FastForwardSpeedIndex], Deadline, &Count);
+				PushRewindFrame(Rewind, M);
+				EmulatedFrameCount += Count;
+			}
+			else {
+				FrameBuffer = RunFrameAhead(M, RunAheadFrames, RunAheadState, RunAheadStateSize);
+				PushRewindFrame(Rewind, M);
+				EmulatedFrameCount += 1;
+			}
 		}
 
 		if (FrameSteppingMode) {
 			Paused = true;
 		}
 
+		f64 EmulatedTime = GetTime();
+
 		// Queue audio.
-		SDL_QueueAudio(AudioDeviceID, M.APU.AudioBuffer, M.APU.AudioPointer);
-		M.APU.AudioPointer = 0;
+		SDL_QueueAudio(AudioDeviceID, M.AudioBuffer, M.AudioPointer);
+		M.AudioPointer = 0;
 
-		// Adjust the APU output sample rate to avoid buffer under- and overruns.
 		QueuedAudioSize = 0.95 * QueuedAudioSize + 0.05 * SDL_GetQueuedAudioSize(AudioDeviceID);
-		M.APU.AudioSampleRate = 44100 + (4096 - QueuedAudioSize) * 0.2;
-		//printf("%5u %10.2lf %10.2lf\n", SDL_GetQueuedAudioSize(AudioDeviceID), QueuedAudioSize, M.APU.AudioSampleRate);
+
+		if (Pacer.Mode == PaceAudio) {
+			// Keep the sample rate fixed, and instead move the frame deadlines
+			// to keep the queue level, so the audio device clock sets the pace.
+			M.AudioSampleRate = 44100;
+			Deadline += (QueuedAudioSize - 4096) / 44100 * 0.05;
+		}
+		else {
+			// Adjust the APU output sample rate to avoid buffer under- and overruns.
+			M.AudioSampleRate = 44100 + (4096 - QueuedAudioSize) * 0.2;
+		}
+		//printf("%5u %10.2lf %10.2lf\n", SDL_GetQueuedAudioSize(AudioDeviceID), QueuedAudioSize, M.AudioSampleRate);
 
 		// Display the finished frame buffer.
 		SDL_LockSurface(Surface);
-		u32* FrameBuffer = M.PPU.FrameBuffer[~M.PPU.Frame & 1];
 		u32* Pixels = (u32*)Surface->pixels;
 		for (i32 Y = 0; Y < 960; Y++) {
 			u32* FrameBufferLine = FrameBuffer + (Y >> 2) * 256;
@@ -213,27 +614,40 @@ int main(int argc, char* args[])
 		SDL_UnlockSurface(Surface);
 		SDL_UpdateWindowSurface(Window);
 
-		TimeToNextFrame += 1000.0 / 60.0;
-
-		while (TimeToNextFrame > 0.0) {
-			// Get time elapsed since last call to SDL_GetTicks64().
-			u64 CurrentTime = SDL_GetTicks64();
-			i64 DeltaTime = CurrentTime - PreviousTime;
-			PreviousTime = CurrentTime;
+		f64 PresentTime = GetTime();
+
+		// Fast-forward fills the frame period by design, so it is not
+		// used to tune the frame delay.
+		if (!FastForward)
+			UpdateFrameDelay(FrameDelay, Deadline, InputTime, EmulatedTime, PresentTime);
+		UpdateFramePacer(Pacer, PresentTime);
+
+		// Show speed and frame timing statistics in the window title once a second.
+		if (PresentTime - StatsTime >= 1.0) {
+			f64 Speed = EmulatedFrameCount / (PresentTime - StatsTime) / 60.0988;
+			char StatsTitle[1280];
+			snprintf(StatsTitle, sizeof(StatsTitle), "%s | speed %.2fx, delay %.1f ms, latency %.1f ms, missed %llu/%llu",
+				Title, Speed, FrameDelay.Delay * 1000.0, FrameDelay.Latency * 1000.0,
+				(unsigned long long)FrameDelay.MissCount, (unsigned long long)FrameDelay.FrameCount);
+			SDL_SetWindowTitle(Window, StatsTitle);
+			StatsTime = PresentTime;
+			EmulatedFrameCount = 0;
+		}
 
-			// Subtract from time to next frame.
-			TimeToNextFrame -= DeltaTime;
+		Deadline += FramePeriod;
 
-			// Don't try to catch up for more than 100 ms when lagging behind.
-			// This is to stop the emulator from going wild if the event loop
-			// was paused (for example, when the open file dialog was active).
-			if (TimeToNextFrame < -100.0)
-				TimeToNextFrame = -100.0;
-		}
+		// Don't try to catch up for more than 100 ms when lagging behind.
+		// This is to stop the emulator from going wild if the event loop
+		// was paused (for example, when the open file dialog was active).
+		if (Deadline < PresentTime - 0.1)
+			Deadline = PresentTime - 0.1;
 
 		CurrentFrame++;
 	}
 
+	DestroyRewindBuffer(Rewind);
+	free(RunAheadState);
+
 	SDL_DestroyWindow(Window);
 
 	SDL_Quit();
@@ -22,10 +22,16 @@ static inline void WriteCIRAM(machine& Machine, u16 Address, u8 Data)
 {
 	u16 Offset = NameTableOffset(Machine.Mapper.MirrorMode, Address);
 	Machine.CIRAM[Offset] = Data;
+	MarkPageDirty(Machine, CIRAMPageBase + (Offset >> 8));
 }
 
 /* --- Mapper 000 ---------------------------------------------------------- */
 
+static inline u32 PRGROMOffset0(machine& Machine, u16 Address)
+{
+	return Address & (Machine.PRGROMSize - 1);
+}
+
 u8 ReadMapper0(machine& Machine, u16 Address)
 {
 	// PPU $0000-$1FFF: CHR RAM.
@@ -41,14 +47,17 @@ u8 ReadMapper0(machine& Machine, u16 Address)
 	if (Address < 0x8000) return Machine.PRGRAM[Address & 0x0FFF];
 
 	// CPU $8000-$FFFF: PRG ROM.
-	return Machine.PRGROM[Address & (Machine.PRGROMSize - 1)];
+	return Machine.PRGROM[PRGROMOffset0(Machine, Address)];
 }
 
 void WriteMapper0(machine& Machine, u16 Address, u8 Data)
 {
 	// PPU $0000-$1FFF: CHR RAM.
 	if (Address < 0x2000) {
-		Machine.CHR[Address] = Data;
+		if (Machine.CHRIsRAM) {
+			Machine.CHR[Address] = Data;
+			MarkPageDirty(Machine, CHRRAMPageBase + (Address >> 8));
+		}
 		return;
 	}
 
@@ -64,6 +73,7 @@ void WriteMapper0(machine& Machine, u16 Address, u8 Data)
 	// CPU $6000-$7FFF: PRG RAM.
 	if (Address < 0x8000) {
 		Machine.PRGRAM[Address & 0x0FFF] = Data;
+		MarkPageDirty(Machine, PRGRAMPageBase + ((Address & 0x0FFF) >> 8));
 		return;
 	}
 
@@ -107,6 +117,27 @@ static void Mapper01ComputeBankMaps(machine& Machine)
 	}
 }
 
+static inline u32 PRGROMOffset1(machine& Machine, u16 Address)
+{
+	mapper1& Mapper = Machine.Mapper._1;
+
+	u32 Base = Mapper.PRGMap[(Address >> 14) & 1];
+	u32 Offset = Address & 0x3FFF;
+	return Base + Offset;
+}
+
+// The CHR bank registers have 5 bits, and boards with little CHR (e.g. SUROM
+// and SXROM, which use bit 4 for PRG) select banks past its end, so the
+// offset wraps around the CHR size.
+static inline u32 CHROffset1(machine& Machine, u16 Address)
+{
+	mapper1& Mapper = Machine.Mapper._1;
+
+	u32 Base = Mapper.CHRMap[(Address >> 12) & 1];
+	u32 Offset = Address & 0x0FFF;
+	return (Base + Offset) & (Machine.CHRSize - 1);
+}
+
 void ResetMapper1(machine& Machine)
 {
 	mapper1& Mapper = Machine.Mapper._1;
@@ -118,14 +149,8 @@ void ResetMapper1(machine& Machine)
 
 u8 ReadMapper1(machine& Machine, u16 Address)
 {
-	mapper1& Mapper = Machine.Mapper._1;
-
 	// PPU $0000-$1FFF: CHR RAM.
-	if (Address < 0x2000) {
-		u32 Base = Mapper.CHRMap[(Address >> 12) & 1];
-		u32 Offset = Address & 0x0FFF;
-		return Machine.CHR[Base + Offset];
-	}
+	if (Address < 0x2000) return Machine.CHR[CHROffset1(Machine, Address)];
 
 	// PPU $2000-$3FFF: CIRAM.
 	if (Address < 0x4000) return ReadCIRAM(Machine, Address);
@@ -137,9 +162,7 @@ u8 ReadMapper1(machine& Machine, u16 Address)
 	if (Address < 0x8000) return Machine.PRGRAM[Address & 0x1FFF];
 
 	// CPU $8000-$FFFF: PRG ROM.
-	u32 Base = Mapper.PRGMap[(Address >> 14) & 1];
-	u32 Offset = Address & 0x3FFF;
-	return Machine.PRGROM[Base + Offset];
+	return Machine.PRGROM[PRGROMOffset1(Machine, Address)];
 }
 
 void WriteMapper1(machine& Machine, u16 Address, u8 Data)
@@ -148,9 +171,11 @@ void WriteMapper1(machine& Machine, u16 Address, u8 Data)
 
 	// PPU $0000-$1FFF: CHR RAM.
 	if (Address < 0x2000) {
-		u32 Base = Mapper.CHRMap[(Address >> 12) & 1];
-		u32 Offset = Address & 0x0FFF;
-		Machine.CHR[Base + Offset] = Data;
+		if (Machine.CHRIsRAM) {
+			u32 Offset = CHROffset1(Machine, Address);
+			Machine.CHR[Offset] = Data;
+			MarkPageDirty(Machine, CHRRAMPageBase + (Offset >> 8));
+		}
 		return;
 	}
 
@@ -166,6 +191,7 @@ void WriteMapper1(machine& Machine, u16 Address, u8 Data)
 	// CPU $6000-$7FFF: PRG RAM.
 	if (Address < 0x8000) {
 		Machine.PRGRAM[Address & 0x1FFF] = Data;
+		MarkPageDirty(Machine, PRGRAMPageBase + ((Address & 0x1FFF) >> 8));
 		return;
 	}
 
@@ -192,10 +218,19 @@ void WriteMapper1(machine& Machine, u16 Address, u8 Data)
 
 /* --- Mapper 002 ---------------------------------------------------------- */
 
-u8 ReadMapper2(machine& Machine, u16 Address)
+static inline u32 PRGROMOffset2(machine& Machine, u16 Address)
 {
 	mapper2& Mapper = Machine.Mapper._2;
 
+	// CPU $8000-$BFFF: 16K switchable PRG ROM bank.
+	// CPU $C000-$FFFF: 16K fixed PRG ROM bank.
+	u32 Base = Address < 0xC000 ? Mapper.PRGBank * 0x4000 : Machine.PRGROMSize - 0x4000;
+	u32 Offset = Address & 0x3FFF;
+	return Base + Offset;
+}
+
+u8 ReadMapper2(machine& Machine, u16 Address)
+{
 	// PPU $0000-$1FFF: CHR RAM.
 	if (Address < 0x2000) return Machine.CHR[Address];
 
@@ -205,17 +240,8 @@ u8 ReadMapper2(machine& Machine, u16 Address)
 	// CPU $4000-$7FFF: Unmapped.
 	if (Address < 0x8000) return Machine.BusData;
 
-	// CPU $8000-$BFFF: 16K switchable PRG ROM bank.
-	if (Address < 0xC000) {
-		u32 Base = Mapper.PRGBank * 0x4000;
-		u32 Offset = Address & 0x3FFF;
-		return Machine.PRGROM[Base + Offset];
-	}
-
-	// CPU $C000-$FFFF: 16K fixed PRG ROM bank.
-	u32 Base = Machine.PRGROMSize - 0x4000;
-	u32 Offset = Address & 0x3FFF;
-	return Machine.PRGROM[Base + Offset];
+	// CPU $8000-$FFFF: PRG ROM.
+	return Machine.PRGROM[PRGROMOffset2(Machine, Address)];
 }
 
 void WriteMapper2(machine& Machine, u16 Address, u8 Data)
@@ -224,7 +250,10 @@ void WriteMapper2(machine& Machine, u16 Address, u8 Data)
 
 	// PPU $0000-$1FFF: CHR RAM.
 	if (Address < 0x2000) {
-		Machine.CHR[Address] = Data;
+		if (Machine.CHRIsRAM) {
+			Machine.CHR[Address] = Data;
+			MarkPageDirty(Machine, CHRRAMPageBase + (Address >> 8));
+		}
 		return;
 	}
 
@@ -243,6 +272,11 @@ void WriteMapper2(machine& Machine, u16 Address, u8 Data)
 
 /* --- Mapper 003 ---------------------------------------------------------- */
 
+static inline u32 PRGROMOffset3(machine& Machine, u16 Address)
+{
+	return Address & (Machine.PRGROMSize - 1);
+}
+
 u8 ReadMapper3(machine& Machine, u16 Address)
 {
 	mapper3& Mapper = Machine.Mapper._3;
@@ -257,7 +291,7 @@ u8 ReadMapper3(machine& Machine, u16 Address)
 	if (Address < 0x8000) return Machine.BusData;
 
 	// CPU $8000-$FFFF: PRG ROM.
-	return Machine.PRGROM[Address & (Machine.PRGROMSize - 1)];
+	return Machine.PRGROM[PRGROMOffset3(Machine, Address)];
 }
 
 void WriteMapper3(machine& Machine, u16 Address, u8 Data)
@@ -343,6 +377,15 @@ static void ComputeBankMaps_Mapper4(machine& Machine)
 	}
 }
 
+static inline u32 PRGROMOffset4(machine& Machine, u16 Address)
+{
+	mapper4& Mapper = Machine.Mapper._4;
+
+	u32 Base = Mapper.PRGMap[(Address >> 13) & 3];
+	u32 Offset = Address & 0x1FFF;
+	return Base + Offset;
+}
+
 void ResetMapper4(machine& Machine)
 {
 	ComputeBankMaps_Mapper4(Machine);
@@ -372,9 +415,7 @@ u8 ReadMapper4(machine& Machine, u16 Address)
 	}
 
 	// CPU $8000-$FFFF: 8K PRG ROM banks.
-	u32 Base = Mapper.PRGMap[(Address >> 13) & 3];
-	u32 Offset = Address & 0x1FFF;
-	return Machine.PRGROM[Base + Offset];
+	return Machine.PRGROM[PRGROMOffset4(Machine, Address)];
 }
 
 void WriteMapper4(machine& Machine, u16 Address, u8 Data)
@@ -397,6 +438,7 @@ void WriteMapper4(machine& Machine, u16 Address, u8 Data)
 	if (Address < 0x8000) {
 		if (Mapper.PRGRAMProtect) return;
 		Machine.PRGRAM[Address & 0x1FFF] = Data;
+		MarkPageDirty(Machine, PRGRAMPageBase + ((Address & 0x1FFF) >> 8));
 		return;
 	}
 
@@ -462,3 +504,18 @@ void NotifyMapper4(machine& Machine, mapper_event Event)
 			Machine.Mapper.IRQTrigger = 8;
 	}
 }
+
+/* --- Common -------------------------------------------------------------- */
+
+// Returns the PRG ROM offset that CPU address $8000-$FFFF is currently mapped to.
+u32 GetPRGROMOffset(machine& Machine, u16 Address)
+{
+	switch (Machine.Mapper.ID) {
+		case 0: return PRGROMOffset0(Machine, Address);
+		case 1: return PRGROMOffset1(Machine, Address);
+		case 2: return PRGROMOffset2(Machine, Address);
+		case 3: return PRGROMOffset3(Machine, Address);
+		case 4: return PRGROMOffset4(Machine, Address);
+	}
+	return 0;
+}
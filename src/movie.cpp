@@ -0,0 +1,130 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nes.h"
+
+// Movies record the controller input every time the game latches it, so
+// that playback supplies exactly the same input at the same points of the
+// emulation.  Recording starts from a save state, which is stored in the
+// movie file.
+
+struct movie
+{
+	FILE*           File;
+	bool            Playback;                   // Playing back (otherwise recording).
+	bool            Ended;                      // Playback reached the end or desynced.
+};
+
+static i32 StartMovie(machine& Machine, FILE* File, bool Playback)
+{
+	movie* Movie = (movie*)calloc(1, sizeof(movie));
+	Movie->File = File;
+	Movie->Playback = Playback;
+	Machine.Movie = Movie;
+	return 0;
+}
+
+i32 RecordMovie(machine& Machine, const char* Path)
+{
+	StopMovie(Machine);
+
+	if (!Machine.IsLoaded) return -1;
+
+	u32 StateSize = GetStateSize(Machine);
+	void* State = malloc(StateSize);
+	SaveState(Machine, State, StateSize);
+
+	FILE* File = fopen(Path, "wb");
+	if (!File) {
+		free(State);
+		return -1;
+	}
+
+	movie_file_header Header = {};
+	memcpy(Header.Magic, MovieFileMagic, sizeof(Header.Magic));
+	Header.Version = MovieFileVersion;
+	Header.StateSize = StateSize;
+	Header.ROMHash = Machine.ROMHash;
+	fwrite(&Header, sizeof(Header), 1, File);
+	fwrite(State, 1, StateSize, File);
+	free(State);
+
+	return StartMovie(Machine, File, false);
+}
+
+i32 PlayMovie(machine& Machine, const char* Path)
+{
+	StopMovie(Machine);
+
+	if (!Machine.IsLoaded) return -1;
+
+	FILE* File = fopen(Path, "rb");
+	if (!File) return -1;
+
+	movie_file_header Header;
+	if (fread(&Header, sizeof(Header), 1, File) < 1
+	||  memcmp(Header.Magic, MovieFileMagic, sizeof(Header.Magic)) != 0
+	||  Header.Version != MovieFileVersion
+	||  Header.ROMHash != Machine.ROMHash
+	||  Header.StateSize != GetStateSize(Machine)) {
+		fclose(File);
+		return -1;
+	}
+
+	void* State = malloc(Header.StateSize);
+	if (fread(State, 1, Header.StateSize, File) < Header.StateSize
+	||  LoadState(Machine, State, Header.StateSize) < 0) {
+		free(State);
+		fclose(File);
+		return -1;
+	}
+	free(State);
+
+	return StartMovie(Machine, File, true);
+}
+
+void StopMovie(machine& Machine)
+{
+	if (!Machine.Movie) return;
+
+	fclose(Machine.Movie->File);
+	free(Machine.Movie);
+	Machine.Movie = nullptr;
+}
+
+// Called when the game latches the controller input, after the host has
+// set Machine.Input.  Records the input, or replaces it with the recorded
+// input during playback.
+void UpdateMovie(machine& Machine)
+{
+	movie* Movie = Machine.Movie;
+
+	if (!Movie->Playback) {
+		movie_record Record = {};
+		Record.Cycle = Machine.CPU.Cycle;
+		Record.Input[0] = Machine.Input[0];
+		Record.Input[1] = Machine.Input[1];
+		fwrite(&Record, sizeof(Record), 1, Movie->File);
+		return;
+	}
+
+	if (Movie->Ended) return;
+
+	// Playback ends at the end of the file, or if the game no longer
+	// latches the input at the recorded cycle.
+	movie_record Record;
+	if (fread(&Record, sizeof(Record), 1, Movie->File) < 1 || Record.Cycle != Machine.CPU.Cycle) {
+		Movie->Ended = true;
+		return;
+	}
+
+	Machine.Input[0] = Record.Input[0];
+	Machine.Input[1] = Record.Input[1];
+}
+
+bool IsMoviePlaying(machine& Machine)
+{
+	return Machine.Movie && Machine.Movie->Playback && !Machine.Movie->Ended;
+}
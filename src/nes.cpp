@@ -3,25 +3,29 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <atomic>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
 #include "nes.h"
 
 struct mapper_entry
 {
 	i32             MapperID;
-	mapper_read     Read;
-	mapper_write    Write;
 	mapper_reset    Reset;
-	mapper_notify   Notify;
+	mapper_run      Run;
+	mapper_run      RunTraced;
 };
 
 const mapper_entry MapperTable[] =
 {
-	{ 0, ReadMapper0, WriteMapper0 },
-	{ 1, ReadMapper1, WriteMapper1, ResetMapper1 },
-	{ 2, ReadMapper2, WriteMapper2 },
-	{ 3, ReadMapper3, WriteMapper3 },
-	{ 4, ReadMapper4, WriteMapper4, ResetMapper4, NotifyMapper4 },
+	{ 0, nullptr,      RunUntilVerticalBlank<0, false>, RunUntilVerticalBlank<0, true> },
+	{ 1, ResetMapper1, RunUntilVerticalBlank<1, false>, RunUntilVerticalBlank<1, true> },
+	{ 2, nullptr,      RunUntilVerticalBlank<2, false>, RunUntilVerticalBlank<2, true> },
+	{ 3, nullptr,      RunUntilVerticalBlank<3, false>, RunUntilVerticalBlank<3, true> },
+	{ 4, ResetMapper4, RunUntilVerticalBlank<4, false>, RunUntilVerticalBlank<4, true> },
 	{ -1 }
 };
 
@@ -33,9 +37,19 @@ static const mapper_entry* FindMapperEntry(i32 MapperID)
 	return nullptr;
 }
 
+// Select the run loop variant for the current mapper and trace state.
+void SelectRunLoop(machine& Machine)
+{
+	const mapper_entry* ME = FindMapperEntry(Machine.Mapper.ID);
+	if (!ME) return;
+
+	Machine.Run = Machine.TraceEnable ? ME->RunTraced : ME->Run;
+}
+
 void Reset(machine& Machine)
 {
-	if (Machine.Mapper.Reset) Machine.Mapper.Reset(Machine);
+	const mapper_entry* ME = FindMapperEntry(Machine.Mapper.ID);
+	if (ME && ME->Reset) ME->Reset(Machine);
 
 	Machine.PPU.BackgroundPatternTable = 0;
 	Machine.PPU.SpritePatternTable = 0;
@@ -55,20 +69,35 @@ void Reset(machine& Machine)
 	Machine.PPU.ScanY = 261;
 	Machine.PPU.ScanX = 0;
 
-	Machine.APU.AudioPointer = 0;
+	Machine.AudioPointer = 0;
 
 	Machine.APU.Noise.NoiseRegister = 0x0001;
 
 	Machine.CPU.State = 0;
 }
 
+// Loads the controller shift registers with the current button states.
+// The host is asked for the input only now, when the game latches it.
+static void LatchControllers(machine& Machine)
+{
+	if (Machine.InputPoll) Machine.InputPoll(Machine, Machine.InputContext);
+	if (Machine.Movie) UpdateMovie(Machine);
+
+	Machine.InputData[0] = Machine.Input[0];
+	Machine.InputData[1] = Machine.Input[1];
+}
+
 static inline u8 ReadController(machine& Machine, i32 Index)
 {
+	// While the strobe is set, the shift registers are continuously reloaded.
+	if (Machine.InputStrobe) LatchControllers(Machine);
+
 	u8 Bit = Machine.InputData[Index] & 0x01;
 	Machine.InputData[Index] = 0x80 | Machine.InputData[Index] >> 1;
 	return Bit;
 }
 
+template <i32 MapperID>
 u8 Read(machine& Machine, u16 Address)
 {
 	// $0000-$1FFF: SRAM space.
@@ -78,7 +107,7 @@ u8 Read(machine& Machine, u16 Address)
 
 	// $2000-$3FFF: PPU register space.
 	if (Address < 0x4000) {
-		return Machine.BusData = ReadPPU(Machine, Address & 0x2007);
+		return Machine.BusData = ReadPPU<MapperID>(Machine, Address & 0x2007);
 	}
 
 	// $4000-$401F: CPU register space.
@@ -90,9 +119,10 @@ u8 Read(machine& Machine, u16 Address)
 	}
 
 	// $4020-$FFFF: Cartridge space.
-	return Machine.BusData = ReadMapper(Machine, Address);
+	return Machine.BusData = ReadMapper<MapperID>(Machine, Address);
 }
 
+template <i32 MapperID>
 void Write(machine& Machine, u16 Address, u8 Data)
 {
 	Machine.BusData = Data;
@@ -100,12 +130,13 @@ void Write(machine& Machine, u16 Address, u8 Data)
 	// $0000-$1FFF: SRAM space.
 	if (Address < 0x2000) {
 		Machine.RAM[Address & 0x07FF] = Data;
+		MarkPageDirty(Machine, RAMPageBase + ((Address & 0x07FF) >> 8));
 		return;
 	}
 
 	// $2000-$3FFF: PPU register space.
 	if (Address < 0x4000) {
-		WritePPU(Machine, Address & 0x2007, Data);
+		WritePPU<MapperID>(Machine, Address & 0x2007, Data);
 		return;
 	}
 
@@ -115,12 +146,15 @@ void Write(machine& Machine, u16 Address, u8 Data)
 		if (Address == 0x4014) {
 			u16 Address = u16(Data) << 8;
 			for (u32 I = 0; I < 256; I++)
-				WritePPU(Machine, 0x2004, Read(Machine, Address + I));
+				WritePPU<MapperID>(Machine, 0x2004, Read<MapperID>(Machine, Address + I));
 			Machine.CPU.Stall += 513 + (Machine.CPU.Cycle % 2);
 			return;
 		}
 		if (Address == 0x4016) {
-			Machine.InputStrobe = Data & 0x01;
+			// The shift registers keep the input latched when the strobe is released.
+			bool Strobe = Data & 0x01;
+			if (Machine.InputStrobe && !Strobe) LatchControllers(Machine);
+			Machine.InputStrobe = Strobe;
 			return;
 		}
 		WriteAPU(Machine, Address, Data);
@@ -128,9 +162,10 @@ void Write(machine& Machine, u16 Address, u8 Data)
 	}
 
 	// $4020-$FFFF: Cartridge space.
-	WriteMapper(Machine, Address, Data);
+	WriteMapper<MapperID>(Machine, Address, Data);
 }
 
+template <i32 MapperID, bool Tracing>
 void RunUntilVerticalBlank(machine& Machine)
 {
 	cpu& CPU = Machine.CPU;
@@ -141,18 +176,13 @@ void RunUntilVerticalBlank(machine& Machine)
 	u64 VBC = PPU.VerticalBlankCount;
 
 	while (PPU.VerticalBlankCount == VBC) {
-		if (Machine.InputStrobe) {
-			Machine.InputData[0] = Machine.Input[0];
-			Machine.InputData[1] = Machine.Input[1];
-		}
-
 		// Cycle 0
-		StepPPU(Machine);
-		StepAPU(Machine);
-		StepCPU(Machine);
+		StepPPU<MapperID>(Machine);
+		StepAPU<MapperID>(Machine);
+		StepCPU<MapperID, Tracing>(Machine);
 
 		// Cycle 4
-		StepPPU(Machine);
+		StepPPU<MapperID>(Machine);
 
 		// Cycle 6
 		CPU.NMI = PPU.VerticalBlankFlag && PPU.NMIOutput;
@@ -160,7 +190,7 @@ void RunUntilVerticalBlank(machine& Machine)
 		StepCPUPhase2(Machine);
 
 		// Cycle 8
-		StepPPU(Machine);
+		StepPPU<MapperID>(Machine);
 
 		// Cycle 12
 		Machine.MasterCycle += 12;
@@ -169,112 +199,176 @@ void RunUntilVerticalBlank(machine& Machine)
 	}
 }
 
+void RunUntilVerticalBlank(machine& Machine)
+{
+	// The run loop specialized for the mapper was selected at load time.
+	Machine.Run(Machine);
+}
+
+template u8   Read<0>(machine& Machine, u16 Address);
+template u8   Read<1>(machine& Machine, u16 Address);
+template u8   Read<2>(machine& Machine, u16 Address);
+template u8   Read<3>(machine& Machine, u16 Address);
+template u8   Read<4>(machine& Machine, u16 Address);
+
+template void Write<0>(machine& Machine, u16 Address, u8 Data);
+template void Write<1>(machine& Machine, u16 Address, u8 Data);
+template void Write<2>(machine& Machine, u16 Address, u8 Data);
+template void Write<3>(machine& Machine, u16 Address, u8 Data);
+template void Write<4>(machine& Machine, u16 Address, u8 Data);
+
 void Unload(machine& Machine)
 {
-	free(Machine.RAM               ); Machine.RAM = nullptr;
-	free(Machine.CIRAM             ); Machine.CIRAM = nullptr;
-	free(Machine.PRGRAM            ); Machine.PRGRAM = nullptr;
-	free(Machine.PRGROM            ); Machine.PRGROM = nullptr;
-	free(Machine.CHR               ); Machine.CHR = nullptr;
-	free(Machine.APU.AudioBuffer   ); Machine.APU.AudioBuffer = nullptr;
-	free(Machine.PPU.FrameBuffer[0]); Machine.PPU.FrameBuffer[0] = nullptr;
-	free(Machine.PPU.FrameBuffer[1]); Machine.PPU.FrameBuffer[1] = nullptr;
+	CloseTrace(Machine);
+	SetTraceFilter(Machine, nullptr);
+	StopMovie(Machine);
+	ReleaseROM(Machine.ROM);
+	Machine.ROM = nullptr;
+	Machine.PRGROM = nullptr;
+	Machine.CHR = nullptr;
 	Machine.IsLoaded = false;
 }
 
-i32 Load(machine& Machine, const char* Path)
+// Unloads the machine and frees its arena.
+void FreeMachine(machine& Machine)
 {
-	struct ines_header
-	{
-		u8 Magic[4];
-		u8 NumPRG;
-		u8 NumCHR;
-		u8 Flags6;
-		u8 Flags7;
-		u8 NumRAM;
-		u8 Unused[7];
-	};
-
-	// Clear current data.
 	Unload(Machine);
-	memset(&Machine, 0, sizeof(machine));
+#ifdef _WIN32
+	_aligned_free(Machine.Arena);
+#else
+	free(Machine.Arena);
+#endif
+	Machine.Arena = nullptr;
+	Machine.FrameBuffer[0] = nullptr;
+	Machine.FrameBuffer[1] = nullptr;
+	Machine.AudioBuffer = nullptr;
+	Machine.IndexBuffer = nullptr;
+}
 
-	FILE* File = fopen(Path, "rb");
-	if (!File) return -1;
+i32 Load(machine& Machine, const char* Path)
+{
+	rom* ROM = OpenROM(Path);
+	if (!ROM) return -1;
 
-	// Read header.
-	ines_header Header;
-	if (fread(&Header, 1, sizeof(ines_header), File) < sizeof(ines_header)) {
-		fclose(File);
-		return -1;
-	}
+	i32 Result = Load(Machine, ROM);
+	ReleaseROM(ROM);
+	return Result;
+}
 
-	// Verify header magic.
-	const u8 INESMagic[4] = { 'N', 'E', 'S', 0x1A };
-	for (int K = 0; K < 4; K++) {
-		if (Header.Magic[K] != INESMagic[K]) {
-			fclose(File);
-			return -1;
-		}
+// Loads a ROM image shared with other machines.  The machine keeps a
+// reference to the image until it is unloaded.
+i32 Load(machine& Machine, rom* ROM)
+{
+	const mapper_entry* ME = FindMapperEntry(ROM->MapperID);
+	if (!ME) return -1;
+
+	// The frame, index and audio buffers are placed in a single,
+	// page aligned arena, allocated on the first load.  It is
+	// allocated before unloading, so that the machine is left
+	// as it was if the allocation fails.
+	u8* Arena = Machine.Arena;
+	if (!Arena) {
+#ifdef _WIN32
+		Arena = (u8*)_aligned_malloc(MachineArenaSize, 4096);
+#else
+		Arena = (u8*)aligned_alloc(4096, MachineArenaSize);
+#endif
+		if (!Arena) return -1;
 	}
 
-	i32 MapperID = (Header.Flags6 >> 4) | (Header.Flags7 & 0xF0);
-	u8 MirrorMode = (Header.Flags6 & 0x01) | ((Header.Flags7 >> 2) & 0x02);
+	// Clear current data.  The image may be the one
+	// currently loaded, so take the reference first.
+	// The arena is kept, and reused.
+	RetainROM(ROM);
+	Unload(Machine);
+	memset(&Machine, 0, sizeof(machine));
+
+	Machine.ROM = ROM;
 
 	// Configure mapper.
-	const mapper_entry* ME = FindMapperEntry(MapperID);
+	Machine.Mapper.ID         = ROM->MapperID;
+	Machine.Mapper.MirrorMode = ROM->MirrorMode;
+	Machine.Run               = ME->Run;
 
-	if (!ME) {
-		fclose(File);
-		return -1;
-	}
+	Machine.PRGRAMSize = sizeof(Machine.PRGRAM);
 
-	Machine.Mapper.ID         = MapperID;
-	Machine.Mapper.MirrorMode = MirrorMode;
-	Machine.Mapper.Reset      = ME->Reset;
-	Machine.Mapper.Read       = ME->Read;
-	Machine.Mapper.Write      = ME->Write;
-	Machine.Mapper.Notify     = ME->Notify;
-
-	// Allocate RAM.
-	Machine.RAM = (u8*)calloc(2048, 1);
-	Machine.CIRAM = (u8*)calloc(2048, 1);
-
-	// Allocate PRG RAM.
-	Machine.PRGRAMSize = 8192;
-	Machine.PRGRAM = (u8*)calloc(8192, 1);
-
-	// Load PRG ROM data.
-	Machine.PRGROMSize = Header.NumPRG * 16384;
-	Machine.PRGROM = (u8*)calloc(Machine.PRGROMSize, 1);
-	if (fread(Machine.PRGROM, 1, Machine.PRGROMSize, File) < Machine.PRGROMSize) {
-		fclose(File);
-		return -1;
-	}
-	
-	// Load CHR ROM data.
-	if (Header.NumCHR > 0) {
-		Machine.CHRSize = Header.NumCHR * 8192;
-		Machine.CHR = (u8*)calloc(Machine.CHRSize, 1);
-		if (fread(Machine.CHR, 1, Machine.CHRSize, File) < Machine.CHRSize) {
-			fclose(File);
-			return -1;
-		}
+	Machine.PRGROMSize = ROM->PRGROMSize;
+	Machine.PRGROM     = ROM->PRGROM;
+
+	// CHR ROM is shared, CHR RAM belongs to the machine.
+	// The mappers only write to CHR if it is RAM.
+	if (ROM->CHRROMSize > 0) {
+		Machine.CHRSize = ROM->CHRROMSize;
+		Machine.CHR = (u8*)ROM->CHRROM;
 	}
 	else {
-		Machine.CHRSize = 8192;
-		Machine.CHR = (u8*)calloc(8192, 1);
+		Machine.CHRSize = sizeof(Machine.CHRRAM);
+		Machine.CHR = Machine.CHRRAM;
+		Machine.CHRIsRAM = true;
 	}
 
-	// Allocate frame buffers.
-	Machine.PPU.FrameBuffer[0] = (u32*)calloc(256 * 240, sizeof(u32));
-	Machine.PPU.FrameBuffer[1] = (u32*)calloc(256 * 240, sizeof(u32));
+	Machine.ROMHash = ROM->Hash;
+
+	memset(Arena, 0, MachineArenaSize);
 
-	Machine.APU.AudioBuffer = (u8*)calloc(8192, 1);
+	Machine.Arena          = Arena;
+	Machine.FrameBuffer[0] = (u32*)(Arena + MachineArenaFrameBuffer0);
+	Machine.FrameBuffer[1] = (u32*)(Arena + MachineArenaFrameBuffer1);
+	Machine.AudioBuffer    = Arena + MachineArenaAudioBuffer;
+	Machine.IndexBuffer    = Arena + MachineArenaIndexBuffer;
 
 	Machine.IsLoaded = true;
 
+	// The memory was replaced, also for users of the pages written
+	// while the previous game was loaded.
+	MarkAllPagesDirty(Machine);
+
 	Reset(Machine);
 
 	return 0;
+}
+
+// Returns the memory used by the machine, not counting the shared ROM image.
+u64 GetMachineMemorySize(const machine& Machine)
+{
+	u64 Size = sizeof(machine);
+	if (Machine.Arena) Size += MachineArenaSize;
+	if (Machine.TraceBuffer) Size += u64(Machine.TraceBufferSize) * sizeof(trace_record);
+	if (Machine.TraceFilter) Size += sizeof(trace_filter);
+	return Size;
+}
+
+static std::atomic<u64> LastWriteGeneration;
+
+// Starts a new write generation, and returns it.  Every page written from
+// then on is tagged with a generation at least as large, so each user of
+// the dirty pages (forks and state hashers) keeps the generation it started,
+// and finds the pages written since without clearing anything for the
+// others.  Generations are unique across machines, so a generation
+// started before a machine is loaded is older than all of its pages.
+u64 NewWriteGeneration(machine& Machine)
+{
+	Machine.WriteGeneration = LastWriteGeneration.fetch_add(1, std::memory_order_relaxed) + 1;
+	return Machine.WriteGeneration;
+}
+
+// Copies the bitmap of memory pages written since the given write generation
+// was started (MemoryPageCount bits, see MemoryPageSize).
+void GetDirtyPages(const machine& Machine, u64 Generation, u64* Bitmap)
+{
+	Bitmap[0] = 0;
+	Bitmap[1] = 0;
+	for (u32 Page = 0; Page < MemoryPageCount; Page++) {
+		if (Machine.PageGenerations[Page] >= Generation)
+			Bitmap[Page >> 6] |= 1ull << (Page & 63);
+	}
+}
+
+// Must be called after overwriting the machine state other than through
+// the bus, e.g. by copying it from another machine.
+void MarkAllPagesDirty(machine& Machine)
+{
+	NewWriteGeneration(Machine);
+	for (u32 Page = 0; Page < MemoryPageCount; Page++)
+		MarkPageDirty(Machine, Page);
 }
\ No newline at end of file
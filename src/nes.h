@@ -1,7 +1,9 @@
 #pragma once
 
 #include <stdio.h>
+#include <stddef.h>
 #include <cstdint>
+#include <type_traits>
 
 using u8 = std::uint8_t;
 using u16 = std::uint16_t;
@@ -94,7 +96,10 @@ const u32 PPUColorTable[64] =
 	0xFFB5EBF2, 0xFFB8B8B8, 0xFF000000, 0xFF000000,
 };
 
-struct ppu
+// The fields used on every PPU cycle come first, and fit in the first three
+// cache lines.  Fields used only for register accesses and once per scan
+// line come after them.
+struct alignas(64) ppu
 {
 	u64             MasterCycle;                // Current master clock cycle.
 
@@ -103,24 +108,14 @@ struct ppu
 	u32             ScanX;                      // Current scan line cycle.
 	bool            VerticalBlankFlag;          // Vertical blank active.
 	bool            VerticalBlankFlagInhibit;   // Inhibit vblank flag for 1 PPU cycle.
-	u64             VerticalBlankCount;
-
-	u32*            FrameBuffer[2];             // Frame buffers (256x240, RGBA8).
 
 	u16             V;                          // Current VRAM address.
 	u16             T;                          // Scroll, Y & coarse X.
 	u8              X;                          // Scroll, fine X.
 	u8              W;                          // Register write H/L byte toggle.
-	u8              VIncrementBy32;             // V increment mode.
 
-	bool            NMIOutput;                  // Generate NMI during V-blank.
 	bool            GrayscaleEnable;            // Select grayscale color table.
-	u8              MasterSlaveSelect;          // PPU master/slave select.
 	u8              TintMode;                   // R/G/B tint flags.
-	u8              OAMAddress;                 // OAMADDR.
-	u8              ReadBuffer;                 // PPUDATA read buffer.
-	u8              BusData;                    // Open bus data.
-	u64             BusDataRefreshCycle[8];     // For each bus data line bit, the master cycle it was last driven.
 
 	bool            BackgroundEnable;           // Enable background rendering.
 	bool            BackgroundShowLeftMargin;   // Show background at X < 8.
@@ -137,19 +132,34 @@ struct ppu
 	u8              SpritePatternTable;         // Active sprite pattern table (8x8 sprites only).
 	bool            Sprite8x16;                 // Use 8x16 sprites.
 
-	bool            SpriteOverflow;             // Found more than 8 sprites on this scan line.
 	bool            SpriteZeroHit;              // Sprite 0 collided with background.
 	u8              SpriteCount;                // Number of sprites on this scan line.
 	u8              SpriteIndex[8];             // OAM indices of sprites.
 	u8              SpritePriority[8];          // Sprite BG priority bits.
 	u8              SpriteX[8];                 // Sprite X coordinates.
-	u8              SpriteY[8];                 // Sprite Y coordinates.
 	u32             SpriteColorData[8];         // Sprite row color data (8 pixels, 4 bpp).
 
-	u8              SpriteOAM[256];             // Sprite OAM memory (64 sprites).
 	u8              Palette[32];                // Active palette (indexes PPU color table).
+
+	// Register access and per scan line state.
+
+	u64             VerticalBlankCount;
+
+	u8              VIncrementBy32;             // V increment mode.
+	bool            NMIOutput;                  // Generate NMI during V-blank.
+	u8              MasterSlaveSelect;          // PPU master/slave select.
+	u8              OAMAddress;                 // OAMADDR.
+	u8              ReadBuffer;                 // PPUDATA read buffer.
+	u8              BusData;                    // Open bus data.
+	u64             BusDataRefreshCycle[8];     // For each bus data line bit, the master cycle it was last driven.
+
+	bool            SpriteOverflow;             // Found more than 8 sprites on this scan line.
+	u8              SpriteY[8];                 // Sprite Y coordinates.
+	u8              SpriteOAM[256];             // Sprite OAM memory (64 sprites).
 };
 
+static_assert(offsetof(ppu, Palette) + sizeof(ppu::Palette) <= 3 * 64, "PPU per-cycle fields must fit in three cache lines");
+
 /* --- APU: Audio Processing Unit ------------------------------------------ */
 
 // Duty cycle sequences for the pulse channels.
@@ -277,10 +287,13 @@ struct apu_dmc
 	u8              Output;                     // Current output value.
 };
 
-struct apu
+// The APU is stepped on every CPU cycle.  The frame sequencer, the channel
+// timers and sequencers, and the audio sample counter are used on every
+// cycle, and come first in the first two cache lines.  The frame count and
+// the sample output state follow.
+struct alignas(64) apu
 {
 	u64             Cycle;                      // Current global CPU cycle.
-	u64             Frame;                      // Current APU frame.
 	u16             FrameCycle;                 // Current cycle within APU frame.
 	u8              FrameCycleResetTimer;       // Timer for FrameCycle reset after register write.
 	u8              FrameCounterMode;           // Frame counter mode.
@@ -293,18 +306,20 @@ struct apu
 	apu_noise       Noise;                      // Noise channel.
 	apu_dmc         DMC;                        // Delta-modulation channel.
 
-	f64             AudioSampleRate;            // Output audio sample rate.
 	f64             AudioSampleCount;
 
-	i32             AudioPointer;               // Audio buffer write position.
+	// Per frame and per audio sample state.
+
+	u64             Frame;                      // Current APU frame.
 	u64             AudioSampleCycle;
 	f64             AudioSample;
-	u8*             AudioBuffer;                // Audio buffer.
 
 	f64             AudioSamplePrevious;
 	f64             AudioSampleIntegrator;
 };
 
+static_assert(offsetof(apu, AudioSampleCount) + sizeof(f64) <= 2 * 64, "APU per-cycle fields must fit in two cache lines");
+
 /* --- Mappers ------------------------------------------------------------- */
 
 struct mapper1
@@ -350,9 +365,8 @@ enum mapper_event
 };
 
 using mapper_reset  = void (*)(struct machine& Machine);
-using mapper_read   = u8   (*)(struct machine& Machine, u16 Address);
-using mapper_write  = void (*)(struct machine& Machine, u16 Address, u8 Data);
-using mapper_notify = void (*)(struct machine& Machine, mapper_event Event);
+using mapper_run    = void (*)(struct machine& Machine);
+using input_poll    = void (*)(struct machine& Machine, void* Context);
 
 struct mapper
 {
@@ -361,11 +375,6 @@ struct mapper
 
 	u8              IRQTrigger;                 // Mapper IRQ.
 
-	mapper_reset    Reset;
-	mapper_read     Read;
-	mapper_write    Write;
-	mapper_notify   Notify;
-
 	union
 	{
 		mapper1     _1;
@@ -375,6 +384,279 @@ struct mapper
 	};
 };
 
+/* --- Tracing ------------------------------------------------------------- */
+
+// Binary trace file header magic and format version.
+const u8  TraceFileMagic[8] = { 'N', 'E', 'S', 'T', 'R', 'A', 'C', 'E' };
+const u32 TraceFileVersion  = 1;
+
+// Default trace ring buffer size in records (must be a power of two).
+const u32 TraceDefaultBufferSize = 1 << 16;
+
+struct trace_file_header
+{
+	u8              Magic[8];                   // TraceFileMagic.
+	u32             Version;                    // TraceFileVersion.
+	u32             RecordSize;                 // sizeof(trace_record).
+};
+
+// One executed instruction (or interrupt sequence), captured after it completed.
+struct trace_record
+{
+	u64             Cycle;                      // CPU cycle.
+	u16             PC;                         // Instruction address.
+	u16             Immediate;                  // Instruction operand bytes.
+	u16             Address;                    // Effective address (branch target).
+	u16             ScanY;                      // PPU scan line.
+	u16             ScanX;                      // PPU scan line cycle.
+	u8              Opcode;                     // Instruction opcode.
+	u8              Interrupt;                  // cpu_interrupt, if this is an interrupt sequence.
+	u8              A;                          // Accumulator.
+	u8              X;                          // Index X.
+	u8              Y;                          // Index Y.
+	u8              SP;                         // Stack pointer.
+	u8              P;                          // Processor status.
+	u8              Unused[7];
+};
+
+static_assert(sizeof(trace_record) == 32, "Trace record layout is part of the trace file format");
+
+enum trace_filter_flag
+{
+	TraceFilterInterrupts = 0x01,               // Trace NMI and IRQ sequences.
+	TraceFilterAccess     = 0x02,               // Only trace instructions accessing an address set in Access.
+	TraceFilterPRGBank    = 0x04,               // Only trace code at $8000-$FFFF mapped from a bank set in PRGBanks.
+};
+
+// Selects which trace records are produced.  An instruction is traced if
+// the bits for its address and opcode are set, and it passes the optional
+// access and PRG bank checks enabled by the flags.
+struct trace_filter
+{
+	u8              Flags;                      // Combination of trace_filter_flag.
+	u64             PRGBanks;                   // Bit mask of 8K PRG ROM banks.
+	u64             Opcode[256 / 64];           // Bitmap of opcodes.
+	u64             PC[65536 / 64];             // Bitmap of instruction addresses.
+	u64             Access[65536 / 64];         // Bitmap of operand addresses.
+};
+
+inline bool TestTraceFilterBit(const u64* Bitmap, u32 Index)
+{
+	return (Bitmap[Index >> 6] >> (Index & 63)) & 1;
+}
+
+struct trace_writer;
+
+/* --- Rewind -------------------------------------------------------------- */
+
+struct rewind_buffer;
+
+struct rewind_stats
+{
+	u32             FrameCount;                 // Number of frames in the history.
+	u32             KeyframeCount;              // Number of keyframes in the history.
+	u64             ByteCount;                  // Encoded size of the history.
+};
+
+/* --- Save states --------------------------------------------------------- */
+
+// Save state header magic and format version.  The version must be bumped
+// whenever the layout of the saved structures changes.
+const u8  StateMagic[8] = { 'N', 'E', 'S', 'S', 'T', 'A', 'T', 'E' };
+const u32 StateVersion  = 4;
+
+// Save states contain the machine_state block.  The ROM data is not
+// saved, but identified by hash.
+struct state_header
+{
+	u8              Magic[8];                   // StateMagic.
+	u32             Version;                    // StateVersion.
+	u32             Size;                       // Total state size in bytes, including the header.
+	u64             ROMHash;                    // Hash of the ROM data the state belongs to.
+};
+
+/* --- Episodes ------------------------------------------------------------ */
+
+// One step of the script run after booting: the controller input
+// to hold, and for how many frames.
+struct episode_input
+{
+	u8              Input[2];                   // Controller button states.
+	u32             FrameCount;                 // Number of frames to hold the input for.
+};
+
+struct episode_config
+{
+	const episode_input* Script;                // Inputs to run after booting (optional).
+	u32             ScriptLength;               // Number of script steps.
+	u32             MaxNoOpFrameCount;          // Maximum number of random no-op frames after a reset.
+	u64             Seed;                       // Seed for the no-op frame counts (0 for default).
+	const char*     CacheDirectory;             // Directory for cached snapshots (optional).
+};
+
+struct episode;
+
+/* --- Observations -------------------------------------------------------- */
+
+// Observations are downsampled grayscale frames for learning agents, stacked
+// over the most recent frames (see observation.cpp).
+struct observation_config
+{
+	u32             Width;                      // Output width, up to 256 (84 if 0).
+	u32             Height;                     // Output height, up to 240 (84 if 0).
+	u32             StackSize;                  // Number of frames in the output stack (4 if 0).
+	bool            MaxPool;                    // Take the maximum of each frame and the one before it.
+};
+
+struct observation;
+
+/* --- Movies -------------------------------------------------------------- */
+
+// Movie file header magic and format version.
+const u8  MovieFileMagic[8] = { 'N', 'E', 'S', 'M', 'O', 'V', 'I', 'E' };
+const u32 MovieFileVersion  = 1;
+
+// A movie file is the header, the save state the recording started from,
+// and a record for every time the game latched the controller input.
+struct movie_file_header
+{
+	u8              Magic[8];                   // MovieFileMagic.
+	u32             Version;                    // MovieFileVersion.
+	u32             StateSize;                  // Size of the save state following the header.
+	u64             ROMHash;                    // Hash of the ROM data the movie belongs to.
+};
+
+struct movie_record
+{
+	u64             Cycle;                      // CPU cycle of the input latch (to detect desyncs).
+	u8              Input[2];                   // Controller button states.
+	u8              Unused[6];
+};
+
+struct movie;
+
+/* --- ROM images ---------------------------------------------------------- */
+
+// A ROM image is loaded once, and shared by any number of machines.
+struct rom
+{
+	u32             RefCount;                   // Number of references to the image.
+	void*           Data;                       // File contents.
+	u64             DataSize;                   // File size in bytes.
+	bool            IsMapped;                   // Data is a read-only file mapping.
+
+	i32             MapperID;
+	u8              MirrorMode;
+	u32             PRGROMSize;                 // PRG ROM size in bytes.
+	const u8*       PRGROM;                     // PRG ROM (points into Data).
+	u32             CHRROMSize;                 // CHR ROM size in bytes (0 if the cartridge has CHR RAM).
+	const u8*       CHRROM;                     // CHR ROM (points into Data).
+	u64             Hash;                       // Hash of PRG ROM and CHR ROM data.
+};
+
+/* --- Machine arena ------------------------------------------------------- */
+
+// Offsets of the host buffers in machine::Arena.  The audio buffer holds
+// about 11 frames at 44.1 kHz, so hosts running several frames at a time
+// should take the samples after each frame (see nescore.cpp).
+constexpr u32 MachineAudioBufferSize    = 8192;
+constexpr u32 MachineArenaFrameBuffer0  = 0;
+constexpr u32 MachineArenaFrameBuffer1  = 256 * 240 * 4;
+constexpr u32 MachineArenaAudioBuffer   = 256 * 240 * 4 * 2;
+constexpr u32 MachineArenaIndexBuffer   = MachineArenaAudioBuffer + MachineAudioBufferSize;
+constexpr u32 MachineArenaSize          = MachineArenaIndexBuffer + 256 * 240;
+
+/* --- Memory pages -------------------------------------------------------- */
+
+// The memory arrays of the machine state (RAM, CIRAM, PRG RAM and CHR RAM)
+// are divided into pages, numbered from the start of RAM.  Writes are
+// tracked in machine::PageGenerations (see NewWriteGeneration).
+constexpr u32 MemoryPageSize    = 256;
+constexpr u32 RAMPageBase       = 0;
+constexpr u32 CIRAMPageBase     = 2048 / MemoryPageSize;
+constexpr u32 PRGRAMPageBase    = 4096 / MemoryPageSize;
+constexpr u32 CHRRAMPageBase    = 12288 / MemoryPageSize;
+constexpr u32 MemoryPageCount   = 20480 / MemoryPageSize;
+
+/* --- Forks --------------------------------------------------------------- */
+
+struct fork_node;
+
+/* --- RAM search ---------------------------------------------------------- */
+
+// Comparisons for filtering RAM search candidates.  A value is compared
+// either to a constant, or to the value at another snapshot plus a constant
+// (modulo 256), e.g. equal to the older value plus N for "increased by N".
+enum ram_search_compare
+{
+	RAMSearchEqual,
+	RAMSearchNotEqual,
+	RAMSearchLess,
+	RAMSearchLessOrEqual,
+	RAMSearchGreater,
+	RAMSearchGreaterOrEqual,
+};
+
+struct ram_search;
+
+/* --- State hashing ------------------------------------------------------- */
+
+// Parts of the machine state included in a state hash.
+enum state_hash_flags
+{
+	StateHashRAM        = 0x01,                 // 2K system RAM.
+	StateHashCIRAM      = 0x02,                 // Nametables.
+	StateHashPRGRAM     = 0x04,                 // 8K PRG RAM.
+	StateHashCHRRAM     = 0x08,                 // 8K CHR RAM.
+	StateHashPPU        = 0x10,                 // Scroll position, palette and sprite OAM.
+};
+
+struct state_hash
+{
+	u64             Low;
+	u64             High;
+};
+
+struct state_hasher;
+
+/* --- Archives ------------------------------------------------------------ */
+
+// Maps the state of a machine to the key of its cell in an archive.
+using cell_function = u64 (*)(const struct machine& Machine, void* Context);
+
+enum archive_result
+{
+	ArchiveVisited,                             // The cell was known, and its state was kept.
+	ArchiveImproved,                            // The cell was known, and its state was replaced.
+	ArchiveAdded,                               // The cell is new.
+};
+
+// A cell keeps the best state seen for it: the one with the highest score,
+// and the shortest trajectory among those.
+struct archive_cell
+{
+	state_hash      Key;                        // State hash, or the cell function key in Low (High is 0).
+	f64             Score;                      // Score of the state.
+	u32             FrameCount;                 // Length of the trajectory to the state, in frames.
+	u32             VisitCount;                 // Number of times the cell has been reached.
+	u32             RestoreCount;               // Number of times the state has been restored.
+	void*           State;                      // Save state.
+};
+
+struct archive;
+
+/* --- Batches ------------------------------------------------------------- */
+
+struct batch;
+
+struct batch_thread_stats
+{
+	u64             FrameCount;                 // Frames emulated by the thread.
+	u64             SharedFrameCount;           // Frames copied from identical machines (in lockstep mode).
+	u64             StealCount;                 // Groups of machines taken from other threads.
+	f64             BusyTime;                   // Seconds spent running machines.
+};
+
 /* --- NES ----------------------------------------------------------------- */
 
 enum button
@@ -389,53 +671,107 @@ enum button
 	ButtonRight     = 0x80,
 };
 
-struct machine
+// All mutable emulation state, in one contiguous block without pointers.
+// It can be copied with memcpy to snapshot, restore or clone a machine.
+// The machine state starts with the hot per-cycle state (CPU, PPU, APU and
+// mapper registers), followed by the memory arrays.  Large host buffers are
+// kept in a separate arena (see machine::Arena).
+struct alignas(64) machine_state
 {
-	u64             MasterCycle = 0;            // Current master clock cycle.
-
-	bool            IsLoaded;                   // True if loaded with cartridge data.
-	bool            Battery;
-	bool            TraceEnable;
-	FILE*           TraceFile;
-	u64             TraceLine;
+	cpu             CPU;
+	u64             MasterCycle;                // Current master clock cycle.
+	u8              BusData;                    // Last data on the CPU bus.
+	mapper          Mapper;
+	ppu             PPU;
+	apu             APU;
 
 	u8              Input[2];                   // Controller button states.
 	bool            InputStrobe;                // Controller register strobe.
 	u8              InputData[2];               // Controller register data.
 
-	cpu             CPU;
-	ppu             PPU;
-	apu             APU;
-	mapper          Mapper;
+	alignas(64) u8  RAM[2048];                  // 2K system RAM (cache line aligned).
+	u8              CIRAM[2048];                // 2K PPU internal RAM.
+	u8              PRGRAM[8192];               // PRG RAM.
+	u8              CHRRAM[8192];               // CHR RAM (if the cartridge has no CHR ROM).
+};
 
-	u8              BusData;                    // Last data on the CPU bus.
+static_assert(std::is_trivially_copyable_v<machine_state>, "Machine state must be copyable with memcpy");
+static_assert(offsetof(machine_state, MasterCycle) + sizeof(u64) <= 64, "CPU state and master cycle must share a cache line");
+static_assert(offsetof(machine_state, PPU) % 64 == 0, "PPU state must be cache line aligned");
+static_assert(offsetof(machine_state, APU) % 64 == 0, "APU state must be cache line aligned");
 
-	u8*             RAM;                        // 2K system RAM.
-	u8*             CIRAM;                      // 2K PPU internal RAM.
+// A machine is the emulation state plus the (immutable) cartridge ROM
+// and host-side buffers and settings, which are not part of the state.
+// The host fields used while running come first, so that they share as
+// few cache lines as possible.
+struct machine : machine_state
+{
+	mapper_run      Run;                        // Run loop specialized for the mapper (and tracing).
+	const u8*       PRGROM;                     // PRG ROM.
+	u8*             CHR;                        // CHR ROM, or CHRRAM of this machine.
+	bool            CHRIsRAM;                   // True if the cartridge has CHR RAM instead of ROM.
+	bool            VideoDisable;               // Skip frame buffer output (sprite 0 hits are still detected).
+	bool            AudioDisable;               // Skip channel output, mixing and sample generation.
+	bool            TraceEnable;                // Instruction tracing enabled.
+	bool            IndexOutput;                // Write palette indices to IndexBuffer (also when video is disabled).
+	i32             AudioPointer;               // Audio buffer write position.
+	u32*            FrameBuffer[2];             // Frame buffers (256x240, RGBA8).
+	u8*             IndexBuffer;                // Palette indices of the current frame (256x240).
+	u8*             AudioBuffer;                // Audio buffer.
+	f64             AudioSampleRate;            // Output audio sample rate.
+	u64             WriteGeneration;            // Write generation stored in PageGenerations on writes.
+	u64             PageGenerations[MemoryPageCount]; // Write generation of the last write to each memory page.
+
+	bool            IsLoaded;                   // True if loaded with cartridge data.
+	bool            Battery;
+
+	rom*            ROM;                        // ROM image (shared with other machines).
 	u32             PRGROMSize;                 // PRG ROM size in bytes.
-	u8*             PRGRAM;                     // PRG ROM.
 	u32             PRGRAMSize;                 // PRG RAM size in bytes.
-	u8*             PRGROM;                     // PRG RAM.
 	u32             CHRSize;                    // CHR RAM/ROM size in bytes.
-	u8*             CHR;                        // CHR RAM/ROM.
+	u64             ROMHash;                    // Hash of PRG ROM and CHR ROM data.
+
+	u64             ForkID;                     // Fork last made or restored (0 if none).
+	u64             ForkGeneration;             // Write generation started when ForkID was set.
+
+	u8*             Arena;                      // Frame, index and audio buffers (kept when reloading).
+
+	input_poll      InputPoll;                  // Sets Input when the game latches the controllers (optional).
+	void*           InputContext;               // Context passed to InputPoll.
+	movie*          Movie;                      // Movie being recorded or played back.
+
+	FILE*           TraceFile;                  // Binary trace file being streamed to (optional).
+	u64             TraceLine;                  // Number of trace records produced.
+	trace_record*   TraceBuffer;                // Ring buffer of the most recent trace records.
+	u32             TraceBufferSize;            // Trace ring buffer size in records.
+	trace_writer*   TraceWriter;                // Background thread streaming records to TraceFile.
+	trace_filter*   TraceFilter;                // Trace record filter (optional).
 };
 
+// Functions on the emulation hot path are templates over the INES mapper
+// number, so that mapper accesses compile into direct (inlinable) calls.
+// They are explicitly instantiated for each supported mapper.  The CPU core
+// is additionally instantiated with and without instruction tracing.
+
 /* --- cpu.cpp -------------------------------------------------------------- */
 
-void StepCPU(machine& Machine);
+template <i32 MapperID, bool Tracing> void StepCPU(machine& Machine);
 void StepCPUPhase2(machine& Machine);
 
+i32  FormatTraceRecord(char* Buffer, i32 Size, const trace_record& Record, bool Timing);
+i32  SetTraceFilterOperation(trace_filter& Filter, const char* Name, bool Value);
+
 /* --- ppu.cpp -------------------------------------------------------------- */
 
-u8   ReadPPU(machine& Machine, u16 Address);
-void WritePPU(machine& Machine, u16 Address, u8 Data);
-void StepPPU(machine& Machine);
+template <i32 MapperID> u8   ReadPPU(machine& Machine, u16 Address);
+template <i32 MapperID> void WritePPU(machine& Machine, u16 Address, u8 Data);
+template <i32 MapperID> void StepPPU(machine& Machine);
 
 /* --- apu.cpp -------------------------------------------------------------- */
 
 u8   ReadAPU(machine& Machine, u16 Address);
 void WriteAPU(machine& Machine, u16 Address, u8 Data);
-void StepAPU(machine& Machine);
+template <i32 MapperID> void StepAPU(machine& Machine);
 
 /* --- mapper.cpp ----------------------------------------------------------- */
 
@@ -457,28 +793,176 @@ u8   ReadMapper4(machine& Machine, u16 Address);
 void WriteMapper4 (machine& Machine, u16 Address, u8 Data);
 void NotifyMapper4(machine& Machine, mapper_event Event);
 
+u32  GetPRGROMOffset(machine& Machine, u16 Address);
+
+template <i32 MapperID>
 inline u8 ReadMapper(machine& Machine, u16 Address)
 {
-	return Machine.Mapper.Read(Machine, Address);
+	static_assert(MapperID >= 0 && MapperID <= 4, "Unsupported mapper");
+
+	if      constexpr (MapperID == 0) return ReadMapper0(Machine, Address);
+	else if constexpr (MapperID == 1) return ReadMapper1(Machine, Address);
+	else if constexpr (MapperID == 2) return ReadMapper2(Machine, Address);
+	else if constexpr (MapperID == 3) return ReadMapper3(Machine, Address);
+	else                              return ReadMapper4(Machine, Address);
 }
 
+template <i32 MapperID>
 inline void WriteMapper(machine& Machine, u16 Address, u8 Data)
 {
-	Machine.Mapper.Write(Machine, Address, Data);
+	static_assert(MapperID >= 0 && MapperID <= 4, "Unsupported mapper");
+
+	if      constexpr (MapperID == 0) WriteMapper0(Machine, Address, Data);
+	else if constexpr (MapperID == 1) WriteMapper1(Machine, Address, Data);
+	else if constexpr (MapperID == 2) WriteMapper2(Machine, Address, Data);
+	else if constexpr (MapperID == 3) WriteMapper3(Machine, Address, Data);
+	else                              WriteMapper4(Machine, Address, Data);
+}
+
+template <i32 MapperID>
+inline void NotifyMapper(machine& Machine, mapper_event Event)
+{
+	// Only MMC3 (mapper 4) listens to PPU events.
+	if constexpr (MapperID == 4) NotifyMapper4(Machine, Event);
 }
 
 /* --- nes.cpp -------------------------------------------------------------- */
 
 i32  Load(machine& Machine, const char* Path);
+i32  Load(machine& Machine, rom* ROM);
+void Unload(machine& Machine);
+void FreeMachine(machine& Machine);
 void Reset(machine& Machine);
 void RunUntilVerticalBlank(machine& Machine);
 
-u8   Read(machine& Machine, u16 Address);
-void Write(machine& Machine, u16 Address, u8 Data);
+void SelectRunLoop(machine& Machine);
+u64  GetMachineMemorySize(const machine& Machine);
+
+u64  NewWriteGeneration(machine& Machine);
+void GetDirtyPages(const machine& Machine, u64 Generation, u64* Bitmap);
+void MarkAllPagesDirty(machine& Machine);
+
+inline void MarkPageDirty(machine& Machine, u32 Page)
+{
+	Machine.PageGenerations[Page] = Machine.WriteGeneration;
+}
+
+template <i32 MapperID, bool Tracing> void RunUntilVerticalBlank(machine& Machine);
+
+template <i32 MapperID> u8   Read(machine& Machine, u16 Address);
+template <i32 MapperID> void Write(machine& Machine, u16 Address, u8 Data);
 
+template <i32 MapperID>
 inline u16 Read16(machine& Machine, u16 Address)
 {
-	u16 L = Read(Machine, Address);
-	u16 H = Read(Machine, Address + 1);
+	u16 L = Read<MapperID>(Machine, Address);
+	u16 H = Read<MapperID>(Machine, Address + 1);
 	return (H << 8) | L;
 }
+
+/* --- trace.cpp ------------------------------------------------------------ */
+
+i32  OpenTrace(machine& Machine, const char* Path, u32 BufferSize = TraceDefaultBufferSize);
+void CloseTrace(machine& Machine);
+void WriteTraceRecord(machine& Machine, const trace_record& Record);
+u32  DumpTrace(machine& Machine, FILE* File, u32 Count);
+
+void InitTraceFilter(trace_filter& Filter);
+void SetTraceFilterRange(u64* Bitmap, u32 First, u32 Last, bool Value);
+void SetTraceFilter(machine& Machine, const trace_filter* Filter);
+
+/* --- state.cpp ------------------------------------------------------------ */
+
+u32  GetStateSize(const machine& Machine);
+i32  SaveState(machine& Machine, void* Buffer, u32 Size);
+i32  LoadState(machine& Machine, const void* Buffer, u32 Size);
+
+/* --- movie.cpp ------------------------------------------------------------ */
+
+i32  RecordMovie(machine& Machine, const char* Path);
+i32  PlayMovie(machine& Machine, const char* Path);
+void StopMovie(machine& Machine);
+void UpdateMovie(machine& Machine);
+bool IsMoviePlaying(machine& Machine);
+
+/* --- rewind.cpp ----------------------------------------------------------- */
+
+rewind_buffer* CreateRewindBuffer(u32 Size, u32 MaxFrames);
+void DestroyRewindBuffer(rewind_buffer* Buffer);
+void ClearRewindBuffer(rewind_buffer* Buffer);
+void PushRewindFrame(rewind_buffer* Buffer, const machine& Machine);
+i32  PopRewindFrame(rewind_buffer* Buffer, machine& Machine);
+void FlushRewindBuffer(rewind_buffer* Buffer);
+void GetRewindStats(rewind_buffer* Buffer, rewind_stats& Stats);
+
+/* --- fork.cpp ------------------------------------------------------------- */
+
+fork_node* Fork(machine& Machine, const fork_node* Base);
+i32        RestoreFork(machine& Machine, const fork_node* Node);
+fork_node* RetainFork(fork_node* Node);
+void       ReleaseFork(fork_node* Node);
+f64        GetForkMemorySize(const fork_node* Node);
+
+/* --- episode.cpp ---------------------------------------------------------- */
+
+episode* CreateEpisode(machine& Machine, const episode_config& Config);
+void     DestroyEpisode(episode* Episode);
+u32      ResetEpisode(episode* Episode, machine& Machine);
+
+/* --- observation.cpp ------------------------------------------------------ */
+
+observation* CreateObservation(const observation_config& Config);
+void         DestroyObservation(observation* Observation);
+u32          GetObservationSize(const observation* Observation);
+void         ResetObservation(observation* Observation, const machine& Machine, u8* Output);
+void         UpdateObservation(observation* Observation, const machine& Machine, u8* Output);
+void         SkipObservation(observation* Observation, const machine& Machine);
+
+/* --- search.cpp ----------------------------------------------------------- */
+
+ram_search* CreateRAMSearch(u32 MaxSnapshotCount, bool IncludePRGRAM);
+void        DestroyRAMSearch(ram_search* Search);
+void        ResetRAMSearch(ram_search* Search);
+void        ClearRAMSnapshots(ram_search* Search);
+void        AddRAMSnapshot(ram_search* Search, const machine& Machine);
+u32         GetRAMSnapshotCount(const ram_search* Search);
+i32         GetRAMSnapshotValue(const ram_search* Search, u32 Snapshot, u16 Address);
+i32         FilterRAMSearch(ram_search* Search, ram_search_compare Compare, u32 Snapshot, u8 Value);
+i32         FilterRAMSearch(ram_search* Search, ram_search_compare Compare, u32 Newer, u32 Older, u8 Value);
+i32         FilterRAMSearchHistory(ram_search* Search, ram_search_compare Compare, u32 Count, u8 Value);
+u32         GetRAMSearchCandidates(const ram_search* Search, u16* Addresses, u32 MaxCount);
+
+/* --- hash.cpp ------------------------------------------------------------- */
+
+state_hash    HashState(const machine& Machine, u32 Flags);
+state_hasher* CreateStateHasher(u32 Flags);
+void          DestroyStateHasher(state_hasher* Hasher);
+state_hash    UpdateStateHash(state_hasher* Hasher, machine& Machine);
+
+/* --- archive.cpp ---------------------------------------------------------- */
+
+archive*            CreateArchive(cell_function CellFunction, void* Context, u32 HashFlags);
+void                DestroyArchive(archive* Archive);
+archive_result      UpdateArchive(archive* Archive, machine& Machine, f64 Score, u32 FrameCount);
+i32                 FindArchiveCell(const archive* Archive, state_hash Key);
+i32                 FindArchiveCell(const archive* Archive, u64 Key);
+u32                 GetArchiveSize(const archive* Archive);
+const archive_cell* GetArchiveCell(const archive* Archive, u32 Index);
+i32                 RestoreArchiveCell(archive* Archive, u32 Index, machine& Machine);
+
+/* --- rom.cpp -------------------------------------------------------------- */
+
+rom* OpenROM(const char* Path);
+rom* RetainROM(rom* ROM);
+void ReleaseROM(rom* ROM);
+
+/* --- batch.cpp ------------------------------------------------------------ */
+
+batch*   CreateBatch(const char* Path, u32 MachineCount, u32 ThreadCount);
+void     DestroyBatch(batch* Batch);
+u32      GetBatchSize(batch* Batch);
+machine* GetBatchMachine(batch* Batch, u32 Index);
+void     SetBatchLockstep(batch* Batch, bool Enable);
+void     SetBatchRAMSearch(batch* Batch, u32 Index, ram_search* Search);
+u32      RunBatch(batch* Batch, u32 FrameCount);
+u32      GetBatchThreadStats(batch* Batch, batch_thread_stats* Stats, u32 Count);
@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "nes.h"
+#include "nescore.h"
+
+struct nes_machine
+{
+	machine         Machine;
+	bool            AudioEnable;
+	f64             AudioSampleRate;
+	bool            VideoEnable;
+	bool            IndexOutput;
+
+	u8*             Audio;                      // Audio samples generated during the last step.
+	u32             AudioSize;
+	u32             AudioCapacity;
+};
+
+// Load clears the host settings, so they are kept here and applied again.
+static void ApplySettings(nes_machine* M)
+{
+	M->Machine.AudioDisable = !M->AudioEnable;
+	M->Machine.AudioSampleRate = M->AudioSampleRate;
+	M->Machine.VideoDisable = !M->VideoEnable;
+	M->Machine.IndexOutput = M->IndexOutput;
+}
+
+uint32_t nes_api_version(void)
+{
+	return NES_API_VERSION;
+}
+
+nes_machine* nes_create(void)
+{
+	nes_machine* M = new nes_machine();
+	M->AudioEnable = true;
+	M->AudioSampleRate = 44100;
+	M->VideoEnable = true;
+	ApplySettings(M);
+	return M;
+}
+
+void nes_destroy(nes_machine* M)
+{
+	if (!M) return;
+	FreeMachine(M->Machine);
+	free(M->Audio);
+	delete M;
+}
+
+int32_t nes_load(nes_machine* M, const char* Path)
+{
+	i32 Result = Load(M->Machine, Path);
+	ApplySettings(M);
+	M->AudioSize = 0;
+	return Result;
+}
+
+void nes_reset(nes_machine* M)
+{
+	if (!M->Machine.IsLoaded) return;
+	Reset(M->Machine);
+}
+
+void nes_set_audio_sample_rate(nes_machine* M, double SampleRate)
+{
+	M->AudioEnable = SampleRate > 0.0;
+	if (M->AudioEnable) M->AudioSampleRate = SampleRate;
+	ApplySettings(M);
+}
+
+void nes_set_video_enabled(nes_machine* M, int32_t Enabled)
+{
+	M->VideoEnable = Enabled != 0;
+	ApplySettings(M);
+}
+
+void nes_set_index_output_enabled(nes_machine* M, int32_t Enabled)
+{
+	M->IndexOutput = Enabled != 0;
+	ApplySettings(M);
+}
+
+// The audio buffer of the machine only holds a few frames of samples, so
+// the samples are moved to a buffer of the step after each frame.
+static void TakeAudio(nes_machine* M)
+{
+	machine& Machine = M->Machine;
+	u32 Count = u32(Machine.AudioPointer);
+	Machine.AudioPointer = 0;
+	if (!Count) return;
+
+	if (M->AudioSize + Count > M->AudioCapacity) {
+		u32 Capacity = M->AudioCapacity ? 2 * M->AudioCapacity : MachineAudioBufferSize;
+		while (Capacity < M->AudioSize + Count) Capacity *= 2;
+		M->Audio = (u8*)realloc(M->Audio, Capacity);
+		M->AudioCapacity = Capacity;
+	}
+
+	memcpy(M->Audio + M->AudioSize, Machine.AudioBuffer, Count);
+	M->AudioSize += Count;
+}
+
+uint32_t nes_step(nes_machine* M, const uint8_t* Inputs, uint32_t FrameCount, nes_observation* O, uint8_t* Out)
+{
+	machine& Machine = M->Machine;
+	if (!Machine.IsLoaded) return 0;
+
+	M->AudioSize = 0;
+	Machine.AudioPointer = 0;
+
+	for (u32 I = 0; I < FrameCount; I++) {
+		if (Inputs) {
+			Machine.Input[0] = Inputs[2 * I + 0];
+			Machine.Input[1] = Inputs[2 * I + 1];
+		}
+		RunUntilVerticalBlank(Machine);
+		TakeAudio(M);
+
+		// Max-pool over the last two frames of the step.
+		if (O && I + 2 == FrameCount) SkipObservation((observation*)O, Machine);
+	}
+
+	if (O && FrameCount) UpdateObservation((observation*)O, Machine, Out);
+
+	return FrameCount;
+}
+
+int32_t nes_get_region(nes_machine* M, int32_t Region, nes_region* Out)
+{
+	machine& Machine = M->Machine;
+	if (!Machine.IsLoaded) return -1;
+
+	switch (Region) {
+	case NES_REGION_FRAME_BUFFER:
+		Out->data = Machine.FrameBuffer[Machine.PPU.Frame & 1];
+		Out->size = 256 * 240 * sizeof(u32);
+		return 0;
+	case NES_REGION_RAM:
+		Out->data = Machine.RAM;
+		Out->size = sizeof(Machine.RAM);
+		return 0;
+	case NES_REGION_AUDIO:
+		Out->data = M->Audio;
+		Out->size = M->AudioSize;
+		return 0;
+	case NES_REGION_PRG_RAM:
+		Out->data = Machine.PRGRAM;
+		Out->size = sizeof(Machine.PRGRAM);
+		return 0;
+	case NES_REGION_CIRAM:
+		Out->data = Machine.CIRAM;
+		Out->size = sizeof(Machine.CIRAM);
+		return 0;
+	case NES_REGION_CHR_RAM:
+		Out->data = Machine.CHRRAM;
+		Out->size = sizeof(Machine.CHRRAM);
+		return 0;
+	case NES_REGION_INDEX_BUFFER:
+		if (!Machine.IndexOutput) return -1;
+		Out->data = Machine.IndexBuffer;
+		Out->size = 256 * 240;
+		return 0;
+	}
+
+	return -1;
+}
+
+uint64_t nes_get_frame(nes_machine* M)
+{
+	return M->Machine.PPU.Frame;
+}
+
+uint32_t nes_state_size(nes_machine* M)
+{
+	return GetStateSize(M->Machine);
+}
+
+int32_t nes_save_state(nes_machine* M, void* Buffer, uint32_t Size)
+{
+	return SaveState(M->Machine, Buffer, Size);
+}
+
+int32_t nes_load_state(nes_machine* M, const void* Buffer, uint32_t Size)
+{
+	return LoadState(M->Machine, Buffer, Size);
+}
+
+nes_observation* nes_observation_create(uint32_t Width, uint32_t Height, uint32_t StackSize, int32_t MaxPool)
+{
+	observation_config Config = {};
+	Config.Width = Width;
+	Config.Height = Height;
+	Config.StackSize = StackSize;
+	Config.MaxPool = MaxPool != 0;
+	return (nes_observation*)CreateObservation(Config);
+}
+
+void nes_observation_destroy(nes_observation* O)
+{
+	DestroyObservation((observation*)O);
+}
+
+uint32_t nes_observation_size(nes_observation* O)
+{
+	return GetObservationSize((observation*)O);
+}
+
+void nes_observation_reset(nes_observation* O, nes_machine* M, uint8_t* Out)
+{
+	if (!M->Machine.IsLoaded) return;
+	ResetObservation((observation*)O, M->Machine, Out);
+}
+
+void nes_observation_update(nes_observation* O, nes_machine* M, uint8_t* Out)
+{
+	if (!M->Machine.IsLoaded) return;
+	UpdateObservation((observation*)O, M->Machine, Out);
+}
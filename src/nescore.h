@@ -0,0 +1,100 @@
+#pragma once
+
+/* C interface to the emulator core, for use from other languages through
+ * the nescore shared library.  The interface only uses C types, and is
+ * versioned by NES_API_VERSION.
+ *
+ * Memory regions (frame buffer, RAM, audio) point directly into the
+ * machine, so bindings can read observations without copying them.  The
+ * regions stay valid until the machine is destroyed or loaded again, except
+ * for the frame buffer, which alternates between two buffers, and the audio
+ * samples, which move as the step buffer grows: query them again after each
+ * step. */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32)
+#  if defined(NES_API_BUILD)
+#    define NES_API __declspec(dllexport)
+#  else
+#    define NES_API __declspec(dllimport)
+#  endif
+#else
+#  define NES_API __attribute__((visibility("default")))
+#endif
+
+#define NES_API_VERSION 3
+
+typedef struct nes_machine nes_machine;
+typedef struct nes_observation nes_observation;
+
+enum nes_region_id
+{
+	NES_REGION_FRAME_BUFFER = 0,    /* Most recent frame, 256x240 RGBA8. */
+	NES_REGION_RAM          = 1,    /* 2K system RAM. */
+	NES_REGION_AUDIO        = 2,    /* Audio samples (u8) generated during the last step. */
+	NES_REGION_PRG_RAM      = 3,    /* 8K PRG RAM. */
+	NES_REGION_CIRAM        = 4,    /* 2K PPU internal RAM. */
+	NES_REGION_CHR_RAM      = 5,    /* 8K CHR RAM. */
+	NES_REGION_INDEX_BUFFER = 6,    /* Most recent frame, 256x240 palette indices (if enabled). */
+};
+
+typedef struct nes_region
+{
+	void*           data;
+	uint64_t        size;           /* Size in bytes. */
+} nes_region;
+
+NES_API uint32_t     nes_api_version(void);
+
+NES_API nes_machine* nes_create(void);
+NES_API void         nes_destroy(nes_machine* machine);
+NES_API int32_t      nes_load(nes_machine* machine, const char* path);
+NES_API void         nes_reset(nes_machine* machine);
+
+/* Audio is generated at the given sample rate, or disabled if the rate is 0.
+ * Video output can be disabled when the frame buffer is not observed.  The
+ * index output (palette indices) is needed for observations. */
+NES_API void         nes_set_audio_sample_rate(nes_machine* machine, double sample_rate);
+NES_API void         nes_set_video_enabled(nes_machine* machine, int32_t enabled);
+NES_API void         nes_set_index_output_enabled(nes_machine* machine, int32_t enabled);
+
+/* Runs frame_count frames.  If inputs is not null, it holds two bytes
+ * (controller 1 and 2 button states) for each frame.  Otherwise the current
+ * input is held.  If observation is not null, the observation in out is
+ * updated once with the last frame (max-pooled with the frame before it),
+ * as with frame skipping.  The audio samples of all frames are kept.
+ * Returns the number of frames run. */
+NES_API uint32_t     nes_step(nes_machine* machine, const uint8_t* inputs, uint32_t frame_count,
+                              nes_observation* observation, uint8_t* out);
+
+NES_API int32_t      nes_get_region(nes_machine* machine, int32_t region, nes_region* out);
+NES_API uint64_t     nes_get_frame(nes_machine* machine);
+
+/* Save states.  nes_save_state returns the state size or -1, and
+ * nes_load_state returns 0 or -1. */
+NES_API uint32_t     nes_state_size(nes_machine* machine);
+NES_API int32_t      nes_save_state(nes_machine* machine, void* buffer, uint32_t size);
+NES_API int32_t      nes_load_state(nes_machine* machine, const void* buffer, uint32_t size);
+
+/* Observations: downsampled grayscale frames (width x height bytes, 84x84
+ * if 0), stacked over the last stack_size frames (4 if 0) with the oldest
+ * first, and optionally max-pooled over consecutive frames.  The output
+ * buffer holds nes_observation_size bytes, and is filled by
+ * nes_observation_reset and then updated by nes_step, or after each frame
+ * by nes_observation_update.  Requires the index output
+ * of the machine.  nes_observation_create returns null for sizes larger
+ * than the frame. */
+NES_API nes_observation* nes_observation_create(uint32_t width, uint32_t height, uint32_t stack_size, int32_t max_pool);
+NES_API void             nes_observation_destroy(nes_observation* observation);
+NES_API uint32_t         nes_observation_size(nes_observation* observation);
+NES_API void             nes_observation_reset(nes_observation* observation, nes_machine* machine, uint8_t* out);
+NES_API void             nes_observation_update(nes_observation* observation, nes_machine* machine, uint8_t* out);
+
+#ifdef __cplusplus
+}
+#endif
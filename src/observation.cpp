@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "nes.h"
+
+// Observations turn the palette indices written by the PPU (see
+// machine::IndexOutput) into small grayscale frames, without going through
+// the RGBA frame buffers.  Each frame is converted to luminance with a table
+// indexed by the palette index, and area-downsampled: every output pixel is
+// the average of the source pixels it covers, with the pixels on its edges
+// weighted by the fraction covered.  The downsampled frame is optionally
+// max-pooled with the previous one (to see sprites that flicker between
+// frames), and appended to a stack of the most recent frames in a buffer
+// provided by the caller.
+//
+// The stack holds StackSize frames of Width x Height bytes, oldest first.
+
+struct observation_tap
+{
+	u16             First;                      // First source sample covered.
+	u16             Count;                      // Number of source samples covered.
+	u32             Weights;                    // Offset of the sample weights in observation::Weights.
+};
+
+struct observation
+{
+	u32             Width;
+	u32             Height;
+	u32             StackSize;
+	bool            MaxPool;
+	u8              Luminance[64];              // Luminance of each palette color.
+	observation_tap Columns[256];               // Source columns covered by each output column.
+	observation_tap Rows[240];                  // Source rows covered by each output row.
+	u16*            Weights;                    // Sample weights, in 1/256ths.
+	u8*             Frame;                      // Downsampled frame.
+	u8*             PreviousFrame;              // Downsampled frame before it (for max-pooling).
+};
+
+// Computes the source samples covering each output sample, and their
+// weights.  The weights of each output sample add up to exactly 256.
+// Returns the number of weights written.
+static u32 BuildTaps(u32 SourceSize, u32 Size, observation_tap* Taps, u16* Weights)
+{
+	u32 Offset = 0;
+
+	// In units of 1/Size source samples, output sample I covers
+	// [I * SourceSize, (I + 1) * SourceSize), and source sample
+	// J covers [J * Size, (J + 1) * Size).
+	for (u32 I = 0; I < Size; I++) {
+		u32 Begin = I * SourceSize;
+		u32 End = Begin + SourceSize;
+		u32 First = Begin / Size;
+		u32 Last = (End - 1) / Size;
+
+		observation_tap& Tap = Taps[I];
+		Tap.First = u16(First);
+		Tap.Count = u16(Last - First + 1);
+		Tap.Weights = Offset;
+
+		u32 Total = 0;
+		u32 Largest = Offset;
+		for (u32 J = First; J <= Last; J++) {
+			u32 Low = J * Size > Begin ? J * Size : Begin;
+			u32 High = (J + 1) * Size < End ? (J + 1) * Size : End;
+			u16 Weight = u16(((High - Low) * 256 + SourceSize / 2) / SourceSize);
+			if (J == First || Weight > Weights[Largest]) Largest = Offset;
+			Weights[Offset++] = Weight;
+			Total += Weight;
+		}
+
+		// Give the rounding error to the largest weight.
+		Weights[Largest] = u16(Weights[Largest] + 256 - Total);
+	}
+
+	return Offset;
+}
+
+// Returns null if the configured size is larger than the frame.
+observation* CreateObservation(const observation_config& Config)
+{
+	u32 Width = Config.Width ? Config.Width : 84;
+	u32 Height = Config.Height ? Config.Height : 84;
+	u32 StackSize = Config.StackSize ? Config.StackSize : 4;
+	if (Width > 256 || Height > 240) return nullptr;
+
+	observation* Observation = (observation*)calloc(1, sizeof(observation));
+	Observation->Width = Width;
+	Observation->Height = Height;
+	Observation->StackSize = StackSize;
+	Observation->MaxPool = Config.MaxPool;
+
+	// ITU-R BT.601 luma.
+	for (u32 I = 0; I < 64; I++) {
+		u32 R = (PPUColorTable[I] >> 16) & 0xFF;
+		u32 G = (PPUColorTable[I] >> 8) & 0xFF;
+		u32 B = PPUColorTable[I] & 0xFF;
+		Observation->Luminance[I] = u8((77 * R + 150 * G + 29 * B + 128) >> 8);
+	}
+
+	Observation->Weights = (u16*)calloc(256 + Width + 240 + Height, sizeof(u16));
+	u32 Offset = BuildTaps(256, Width, Observation->Columns, Observation->Weights);
+	BuildTaps(240, Height, Observation->Rows, Observation->Weights + Offset);
+	for (u32 Y = 0; Y < Height; Y++)
+		Observation->Rows[Y].Weights += Offset;
+
+	Observation->Frame = (u8*)calloc(1, Width * Height);
+	Observation->PreviousFrame = (u8*)calloc(1, Width * Height);
+
+	return Observation;
+}
+
+void DestroyObservation(observation* Observation)
+{
+	if (!Observation) return;
+	free(Observation->Weights);
+	free(Observation->Frame);
+	free(Observation->PreviousFrame);
+	free(Observation);
+}
+
+// Returns the size of the output stack in bytes.
+u32 GetObservationSize(const observation* Observation)
+{
+	return Observation->StackSize * Observation->Width * Observation->Height;
+}
+
+// Downsamples the index buffer of the machine into Observation->Frame.
+// Each output row is first accumulated from the source rows it covers
+// at full width, and then the columns are combined.  The accumulation
+// loop is kept free of lookups and branches, so that it vectorizes.
+static void Downsample(observation* Observation, const u8* Indices)
+{
+	const u16* Weights = Observation->Weights;
+	u8* Output = Observation->Frame;
+
+	// Source rows on the edge of an output row are shared with the next
+	// one, so the most recently converted row is kept.
+	u8 Luminance[256];
+	u32 LuminanceRow = ~0u;
+
+	for (u32 Y = 0; Y < Observation->Height; Y++) {
+		const observation_tap& Row = Observation->Rows[Y];
+
+		// At most 255 * 256, as the weights add up to 256.
+		u16 Sums[256] = {};
+
+		for (u32 K = 0; K < Row.Count; K++) {
+			u16 Weight = Weights[Row.Weights + K];
+
+			if (LuminanceRow != Row.First + K) {
+				LuminanceRow = Row.First + K;
+				const u8* Source = Indices + LuminanceRow * 256;
+				for (u32 X = 0; X < 256; X++)
+					Luminance[X] = Observation->Luminance[Source[X] & 0x3F];
+			}
+
+			for (u32 X = 0; X < 256; X++)
+				Sums[X] = u16(Sums[X] + Weight * Luminance[X]);
+		}
+
+		for (u32 X = 0; X < Observation->Width; X++) {
+			const observation_tap& Column = Observation->Columns[X];
+			u32 Sum = 0;
+			for (u32 K = 0; K < Column.Count; K++)
+				Sum += u32(Weights[Column.Weights + K]) * Sums[Column.First + K];
+			Output[Y * Observation->Width + X] = u8((Sum + 32768) >> 16);
+		}
+	}
+}
+
+// Fills every frame of the stack with the current frame of the machine,
+// e.g. at the start of an episode.  The machine should have IndexOutput
+// enabled.
+void ResetObservation(observation* Observation, const machine& Machine, u8* Output)
+{
+	u32 FrameSize = Observation->Width * Observation->Height;
+
+	Downsample(Observation, Machine.IndexBuffer);
+	memcpy(Observation->PreviousFrame, Observation->Frame, FrameSize);
+
+	for (u32 I = 0; I < Observation->StackSize; I++)
+		memcpy(Output + I * FrameSize, Observation->Frame, FrameSize);
+}
+
+// Drops the oldest frame of the stack, and appends the current frame of
+// the machine.  Called once per frame, after running to vertical blank.
+void UpdateObservation(observation* Observation, const machine& Machine, u8* Output)
+{
+	u32 FrameSize = Observation->Width * Observation->Height;
+	u8* Newest = Output + (Observation->StackSize - 1) * FrameSize;
+
+	memmove(Output, Output + FrameSize, (Observation->StackSize - 1) * FrameSize);
+
+	Downsample(Observation, Machine.IndexBuffer);
+
+	u8* Frame = Observation->Frame;
+	u8* PreviousFrame = Observation->PreviousFrame;
+	if (Observation->MaxPool) {
+		for (u32 I = 0; I < FrameSize; I++)
+			Newest[I] = Frame[I] > PreviousFrame[I] ? Frame[I] : PreviousFrame[I];
+	}
+	else
+		memcpy(Newest, Frame, FrameSize);
+
+	Observation->Frame = PreviousFrame;
+	Observation->PreviousFrame = Frame;
+}
+
+// Takes the current frame of the machine as the previous frame for
+// max-pooling, without appending it to the stack.  When several frames
+// are run between updates, this is called for the frame before the
+// update, so that the update max-pools the last two frames run.
+void SkipObservation(observation* Observation, const machine& Machine)
+{
+	if (!Observation->MaxPool) return;
+
+	Downsample(Observation, Machine.IndexBuffer);
+
+	u8* Frame = Observation->Frame;
+	Observation->Frame = Observation->PreviousFrame;
+	Observation->PreviousFrame = Frame;
+}
@@ -14,6 +14,7 @@ static inline u16 PaletteOffset(u16 Address)
 	return Address & 0x1F;
 }
 
+template <i32 MapperID>
 u8 ReadPPU(machine& Machine, u16 Address)
 {
 	ppu& PPU = Machine.PPU;
@@ -45,12 +46,12 @@ u8 ReadPPU(machine& Machine, u16 Address)
 			if (Address < 0x3F00) {
 				BusData = PPU.ReadBuffer;
 				BusMask = 0xFF;
-				PPU.ReadBuffer = ReadMapper(Machine, Address);
+				PPU.ReadBuffer = ReadMapper<MapperID>(Machine, Address);
 			}
 			else {
 				BusData = PPU.Palette[PaletteOffset(Address)];
 				BusMask = 0x3F;
-				PPU.ReadBuffer = ReadMapper(Machine, (PPU.V - 0x1000) & 0x3FFF);
+				PPU.ReadBuffer = ReadMapper<MapperID>(Machine, (PPU.V - 0x1000) & 0x3FFF);
 			}
 
 			PPU.V += PPU.VIncrementBy32 ? 32 : 1;
@@ -75,6 +76,7 @@ u8 ReadPPU(machine& Machine, u16 Address)
 	return PPU.BusData;
 }
 
+template <i32 MapperID>
 void WritePPU(machine& Machine, u16 Address, u8 Data)
 {
 	ppu& PPU = Machine.PPU;
@@ -140,8 +142,8 @@ void WritePPU(machine& Machine, u16 Address, u8 Data)
 				PPU.V = PPU.T;
 				PPU.W = 0;
 
-				if (!(OldV & 0x1000) && (PPU.V & 0x1000) && Machine.Mapper.Notify)
-					Machine.Mapper.Notify(Machine, PPUFilteredA12Edge);
+				if (!(OldV & 0x1000) && (PPU.V & 0x1000))
+					NotifyMapper<MapperID>(Machine, PPUFilteredA12Edge);
 			}
 			break;
 		}
@@ -150,7 +152,7 @@ void WritePPU(machine& Machine, u16 Address, u8 Data)
 				PPU.Palette[PaletteOffset(PPU.V)] = Data;
 			}
 			else {
-				WriteMapper(Machine, PPU.V, Data);
+				WriteMapper<MapperID>(Machine, PPU.V, Data);
 			}
 
 			PPU.V += PPU.VIncrementBy32 ? 32 : 1;
@@ -159,6 +161,7 @@ void WritePPU(machine& Machine, u16 Address, u8 Data)
 	}
 }
 
+template <i32 MapperID>
 void StepPPU(machine& Machine)
 {
 	ppu& PPU = Machine.PPU;
@@ -195,9 +198,14 @@ void StepPPU(machine& Machine)
 	bool IsPreRenderX = PPU.ScanX >= 321 && PPU.ScanX <= 336;
 	bool IsFetchX     = IsRenderX || IsPreRenderX;
 
+	// When video output is disabled, pixels only need to be composed for
+	// the index buffer, or to detect a sprite 0 hit on this scan line.
+	bool IsOutput = !Machine.VideoDisable || Machine.IndexOutput
+		|| (!PPU.SpriteZeroHit && PPU.SpriteCount > 0 && PPU.SpriteIndex[0] == 0);
+
 	// If rendering enabled and in visible area, produce an output pixel.
-	if (IsRendering && IsRenderY && IsRenderX) {
-		u32* FrameBuffer = PPU.FrameBuffer[PPU.Frame & 1];
+	if (IsRendering && IsRenderY && IsRenderX && IsOutput) {
+		u32* FrameBuffer = Machine.FrameBuffer[PPU.Frame & 1];
 		i32 FrameY = PPU.ScanY;
 		i32 FrameX = PPU.ScanX - 1;
 
@@ -237,7 +245,13 @@ void StepPPU(machine& Machine)
 		if ((FinalColor & 0x03) == 0)
 			FinalColor = 0;
 
-		FrameBuffer[FrameY * 256 + FrameX] = PPUColorTable[PPU.Palette[FinalColor]];
+		u8 Color = PPU.Palette[FinalColor];
+
+		if (!Machine.VideoDisable)
+			FrameBuffer[FrameY * 256 + FrameX] = PPUColorTable[Color];
+
+		if (Machine.IndexOutput)
+			Machine.IndexBuffer[FrameY * 256 + FrameX] = Color;
 	}
 
 	// Fetch background tile data from VRAM.
@@ -249,26 +263,26 @@ void StepPPU(machine& Machine)
 			case 1: {
 				// Fetch tile pattern index from nametable.
 				u16 Address = 0x2000 | (PPU.V & 0x0FFF);
-				PPU.TilePatternIndex = ReadMapper(Machine, Address);
+				PPU.TilePatternIndex = ReadMapper<MapperID>(Machine, Address);
 				break;
 			}
 			case 3: {
 				// Fetch tile palette index from attribute table.
 				u16 Address = 0x23C0 | (PPU.V & 0x0C00) | ((PPU.V >> 4) & 0x38) | ((PPU.V >> 2) & 0x07);
 				u8 Shift = ((PPU.V >> 4) & 4) | (PPU.V & 2);
-				PPU.TilePaletteIndex = (ReadMapper(Machine, Address) >> Shift) & 0x03;
+				PPU.TilePaletteIndex = (ReadMapper<MapperID>(Machine, Address) >> Shift) & 0x03;
 				break;
 			}
 			case 5: {
 				// Fetch low byte of tile pattern.
 				u16 Address = PatternTableAddress(PPU.BackgroundPatternTable, PPU.TilePatternIndex, (PPU.V >> 12) & 0x07, 0);
-				PPU.TilePatternL = ReadMapper(Machine, Address);
+				PPU.TilePatternL = ReadMapper<MapperID>(Machine, Address);
 				break;
 			}
 			case 7: {
 				// Fetch high byte of tile pattern.
 				u16 Address = PatternTableAddress(PPU.BackgroundPatternTable, PPU.TilePatternIndex, (PPU.V >> 12) & 0x07, 1);
-				PPU.TilePatternH = ReadMapper(Machine, Address);
+				PPU.TilePatternH = ReadMapper<MapperID>(Machine, Address);
 				break;
 			}
 			case 0: {
@@ -314,8 +328,8 @@ void StepPPU(machine& Machine)
 				else
 					Address = PatternTableAddress(PPU.SpritePatternTable, TileIndex, Row, 0);
 
-				u8 PatternL = ReadMapper(Machine, Address);
-				u8 PatternH = ReadMapper(Machine, Address+8);
+				u8 PatternL = ReadMapper<MapperID>(Machine, Address);
+				u8 PatternH = ReadMapper<MapperID>(Machine, Address+8);
 
 				// Make the color data for the visible sprite row.
 				u8 ColorBase = (Flags & 0x03) << 2;
@@ -419,9 +433,27 @@ void StepPPU(machine& Machine)
 	// memory accesses are not emulated accurately, we instead detect an
 	// (approximately) equivalent condition and notify the mapper.
 	if (IsRendering && IsFetchY && PPU.ScanX == 260)
-		if (Machine.Mapper.Notify) Machine.Mapper.Notify(Machine, PPUFilteredA12Edge);
+		NotifyMapper<MapperID>(Machine, PPUFilteredA12Edge);
 
 	//
 	PPU.MasterCycle += 4;
 	PPU.VerticalBlankFlagInhibit = false;
 }
+
+template u8   ReadPPU<0>(machine& Machine, u16 Address);
+template u8   ReadPPU<1>(machine& Machine, u16 Address);
+template u8   ReadPPU<2>(machine& Machine, u16 Address);
+template u8   ReadPPU<3>(machine& Machine, u16 Address);
+template u8   ReadPPU<4>(machine& Machine, u16 Address);
+
+template void WritePPU<0>(machine& Machine, u16 Address, u8 Data);
+template void WritePPU<1>(machine& Machine, u16 Address, u8 Data);
+template void WritePPU<2>(machine& Machine, u16 Address, u8 Data);
+template void WritePPU<3>(machine& Machine, u16 Address, u8 Data);
+template void WritePPU<4>(machine& Machine, u16 Address, u8 Data);
+
+template void StepPPU<0>(machine& Machine);
+template void StepPPU<1>(machine& Machine);
+template void StepPPU<2>(machine& Machine);
+template void StepPPU<3>(machine& Machine);
+template void StepPPU<4>(machine& Machine);
@@ -0,0 +1,390 @@
+#include <stdlib.h>
+#include <string.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "nes.h"
+
+// The rewind buffer keeps a history of machine states, one per frame, in a
+// fixed-size byte ring.  Every RewindKeyframeInterval frames a keyframe is
+// stored; the other frames are stored as the XOR difference to the previous
+// keyframe.  Both are run-length encoded: consecutive frames differ in few
+// bytes, so the XOR difference is mostly zeros.
+//
+// Pushed states are first copied into a small staging queue, and compressed
+// into the ring by a background thread, so pushing never waits.  When the
+// ring is full, the oldest keyframe and its deltas are discarded.
+
+const u32 RewindKeyframeInterval = 60;
+const u32 RewindStagingCount     = 8;
+
+struct rewind_entry
+{
+	u64             Serial;                     // Push sequence number.
+	u32             Offset;                     // Position in the ring.
+	u32             Size;                       // Encoded size in bytes.
+	bool            Keyframe;                   // True if encoded against zero.
+};
+
+struct rewind_buffer
+{
+	std::mutex              Mutex;
+	std::condition_variable Wake;               // Signals the thread about pushed states.
+	std::condition_variable Idle;               // Signals that the thread finished encoding.
+	std::thread             Thread;
+	bool                    Exit;
+
+	// Staging queue of raw states, newest last.
+	machine_state*  Staging;
+	u64             StagingSerial[RewindStagingCount];
+	u32             StagingFirst;
+	u32             StagingCount;
+	bool            Busy;                       // Thread is encoding a state.
+
+	// Encoded history in the ring, newest last.
+	u8*             Ring;
+	u32             RingSize;
+	u32             WriteOffset;
+	rewind_entry*   Entries;
+	u32             EntryCapacity;
+	u32             EntryFirst;
+	u32             EntryCount;
+	u64             ByteCount;                  // Total size of the entries.
+
+	u64             Serial;                     // Serial number of the next pushed state.
+	bool            NeedKeyframe;               // Encode the next state as a keyframe.
+
+	// Owned by the thread.
+	machine_state*  Key;                        // Current keyframe.
+	u32             KeyAge;                     // Frames encoded against Key.
+	u8*             Scratch;                    // Encoding buffer.
+
+	// Owned by the popping thread.
+	machine_state*  DecodedKey;                 // Most recently decoded keyframe.
+	u64             DecodedKeySerial;
+};
+
+// Worst case encoded size: a literal run header for every 4 bytes plus data.
+static u32 GetMaxEncodedSize()
+{
+	return sizeof(machine_state) + (sizeof(machine_state) / 4 + 1) * 4;
+}
+
+// Encodes State XOR Key (or State, if Key is null) as a sequence of runs:
+// a u16 zero count, a u16 literal count, and the literal bytes.
+static u32 Encode(u8* Output, const machine_state* State, const machine_state* Key)
+{
+	const u8* S = (const u8*)State;
+	const u8* K = (const u8*)Key;
+	u32 Size = sizeof(machine_state);
+
+	auto Diff = [&](u32 I) -> u8 { return K ? S[I] ^ K[I] : S[I]; };
+
+	u8* Out = Output;
+	u32 I = 0;
+
+	while (I < Size) {
+		// Count zero bytes, 8 at a time while possible.
+		u32 Zeros = 0;
+		while (I + 8 <= Size && Zeros + 8 <= 0xFFFF) {
+			u64 A, B = 0;
+			memcpy(&A, S + I, 8);
+			if (K) memcpy(&B, K + I, 8);
+			if (A != B) break;
+			I += 8; Zeros += 8;
+		}
+		while (I < Size && Zeros < 0xFFFF && Diff(I) == 0) {
+			I += 1; Zeros += 1;
+		}
+
+		// Count literal bytes, up to a run of 4 zeros.
+		u32 Start = I;
+		u32 Literals = 0;
+		while (I < Size && Literals < 0xFFFF) {
+			if (Diff(I) == 0) {
+				u32 J = I;
+				while (J < Size && J < I + 4 && Diff(J) == 0) J += 1;
+				if (J == I + 4 || J == Size) break;
+			}
+			I += 1; Literals += 1;
+		}
+
+		u16 Header[2] = { u16(Zeros), u16(Literals) };
+		memcpy(Out, Header, sizeof(Header));
+		Out += sizeof(Header);
+		for (u32 J = 0; J < Literals; J++)
+			*Out++ = Diff(Start + J);
+	}
+
+	return u32(Out - Output);
+}
+
+// Decodes into State, which must hold the keyframe (or zeros).
+static void Decode(machine_state* State, const u8* Input, u32 InputSize)
+{
+	u8* S = (u8*)State;
+	const u8* In = Input;
+	const u8* End = Input + InputSize;
+	u32 I = 0;
+
+	while (In < End) {
+		u16 Header[2];
+		memcpy(Header, In, sizeof(Header));
+		In += sizeof(Header);
+
+		I += Header[0];
+		for (u32 J = 0; J < Header[1]; J++)
+			S[I++] ^= *In++;
+	}
+}
+
+static rewind_entry& GetEntry(rewind_buffer* Buffer, u32 Index)
+{
+	return Buffer->Entries[(Buffer->EntryFirst + Index) % Buffer->EntryCapacity];
+}
+
+// Removes the oldest keyframe and the deltas encoded against it.
+static void DropOldest(rewind_buffer* Buffer)
+{
+	do {
+		Buffer->ByteCount -= GetEntry(Buffer, 0).Size;
+		Buffer->EntryFirst = (Buffer->EntryFirst + 1) % Buffer->EntryCapacity;
+		Buffer->EntryCount -= 1;
+	}
+	while (Buffer->EntryCount > 0 && !GetEntry(Buffer, 0).Keyframe);
+}
+
+// Stores an encoded state as the newest entry.  Returns false if it
+// could not be stored.
+static bool Append(rewind_buffer* Buffer, u64 Serial, bool Keyframe, const u8* Data, u32 Size)
+{
+	if (Size > Buffer->RingSize) return false;
+
+	if (Buffer->EntryCount == Buffer->EntryCapacity)
+		DropOldest(Buffer);
+
+	// Wrap around if the entry does not fit at the end of the ring.
+	u32 Offset = Buffer->WriteOffset;
+	bool Wrap = Offset + Size > Buffer->RingSize;
+	if (Wrap) Offset = 0;
+
+	// Make room by discarding old entries.
+	while (Buffer->EntryCount > 0) {
+		rewind_entry& E = GetEntry(Buffer, 0);
+		bool Overlap = E.Offset < Offset + Size && Offset < E.Offset + E.Size;
+		bool Skipped = Wrap && E.Offset >= Buffer->WriteOffset;
+		if (!Overlap && !Skipped) break;
+		DropOldest(Buffer);
+	}
+
+	// A delta is useless without its keyframe.
+	if (!Keyframe && Buffer->EntryCount == 0) return false;
+
+	memcpy(Buffer->Ring + Offset, Data, Size);
+
+	rewind_entry& E = GetEntry(Buffer, Buffer->EntryCount);
+	E.Serial = Serial;
+	E.Offset = Offset;
+	E.Size = Size;
+	E.Keyframe = Keyframe;
+
+	Buffer->EntryCount += 1;
+	Buffer->ByteCount += Size;
+	Buffer->WriteOffset = Offset + Size;
+
+	return true;
+}
+
+static void RunRewindThread(rewind_buffer* Buffer)
+{
+	std::unique_lock<std::mutex> Lock(Buffer->Mutex);
+
+	for (;;) {
+		Buffer->Wake.wait(Lock, [Buffer] { return Buffer->Exit || Buffer->StagingCount > 0; });
+		if (Buffer->Exit) break;
+
+		// Take the oldest staged state.
+		u32 Index = Buffer->StagingFirst;
+		u64 Serial = Buffer->StagingSerial[Index];
+
+		bool Keyframe = Buffer->NeedKeyframe || Buffer->KeyAge >= RewindKeyframeInterval;
+		Buffer->NeedKeyframe = false;
+		Buffer->Busy = true;
+
+		// Encode without holding the lock.  While Busy is set, the state
+		// stays in the queue: Push does not drop it, and Pop and Clear wait.
+		Lock.unlock();
+
+		machine_state* State = &Buffer->Staging[Index];
+		u32 Size;
+		if (Keyframe) {
+			memcpy(Buffer->Key, State, sizeof(machine_state));
+			Buffer->KeyAge = 0;
+			Size = Encode(Buffer->Scratch, State, nullptr);
+		}
+		else {
+			Size = Encode(Buffer->Scratch, State, Buffer->Key);
+		}
+		Buffer->KeyAge += 1;
+
+		Lock.lock();
+
+		Buffer->StagingFirst = (Buffer->StagingFirst + 1) % RewindStagingCount;
+		Buffer->StagingCount -= 1;
+		if (!Append(Buffer, Serial, Keyframe, Buffer->Scratch, Size))
+			Buffer->NeedKeyframe = true;
+
+		Buffer->Busy = false;
+		Buffer->Idle.notify_all();
+	}
+}
+
+rewind_buffer* CreateRewindBuffer(u32 Size, u32 MaxFrames)
+{
+	rewind_buffer* Buffer = new rewind_buffer();
+
+	Buffer->Staging = new machine_state[RewindStagingCount]();
+	Buffer->Ring = (u8*)malloc(Size);
+	Buffer->RingSize = Size;
+	Buffer->Entries = (rewind_entry*)calloc(MaxFrames, sizeof(rewind_entry));
+	Buffer->EntryCapacity = MaxFrames;
+	Buffer->NeedKeyframe = true;
+	Buffer->Key = new machine_state();
+	Buffer->Scratch = (u8*)malloc(GetMaxEncodedSize());
+	Buffer->DecodedKey = new machine_state();
+	Buffer->DecodedKeySerial = ~0ull;
+
+	Buffer->Thread = std::thread(RunRewindThread, Buffer);
+
+	return Buffer;
+}
+
+void DestroyRewindBuffer(rewind_buffer* Buffer)
+{
+	if (!Buffer) return;
+
+	{
+		std::lock_guard<std::mutex> Lock(Buffer->Mutex);
+		Buffer->Exit = true;
+	}
+	Buffer->Wake.notify_one();
+	Buffer->Thread.join();
+
+	delete[] Buffer->Staging;
+	free(Buffer->Ring);
+	free(Buffer->Entries);
+	delete Buffer->Key;
+	free(Buffer->Scratch);
+	delete Buffer->DecodedKey;
+
+	delete Buffer;
+}
+
+void ClearRewindBuffer(rewind_buffer* Buffer)
+{
+	std::unique_lock<std::mutex> Lock(Buffer->Mutex);
+	Buffer->Idle.wait(Lock, [Buffer] { return !Buffer->Busy; });
+
+	Buffer->StagingCount = 0;
+	Buffer->EntryCount = 0;
+	Buffer->ByteCount = 0;
+	Buffer->WriteOffset = 0;
+	Buffer->NeedKeyframe = true;
+	Buffer->DecodedKeySerial = ~0ull;
+}
+
+void PushRewindFrame(rewind_buffer* Buffer, const machine& Machine)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Buffer->Mutex);
+
+		// If the thread has fallen behind, drop the oldest staged
+		// state (unless it is being encoded, then this one).
+		if (Buffer->StagingCount == RewindStagingCount) {
+			if (Buffer->Busy) return;
+			Buffer->StagingFirst = (Buffer->StagingFirst + 1) % RewindStagingCount;
+			Buffer->StagingCount -= 1;
+		}
+
+		u32 Index = (Buffer->StagingFirst + Buffer->StagingCount) % RewindStagingCount;
+		memcpy(&Buffer->Staging[Index], (const machine_state*)&Machine, sizeof(machine_state));
+		Buffer->StagingSerial[Index] = Buffer->Serial++;
+		Buffer->StagingCount += 1;
+	}
+
+	Buffer->Wake.notify_one();
+}
+
+// Restores the most recent state in the history and removes it.  The
+// machine must be loaded with the same ROM.  Returns -1 if the history
+// is empty.
+i32 PopRewindFrame(rewind_buffer* Buffer, machine& Machine)
+{
+	std::unique_lock<std::mutex> Lock(Buffer->Mutex);
+	Buffer->Idle.wait(Lock, [Buffer] { return !Buffer->Busy; });
+
+	machine_state* State = (machine_state*)&Machine;
+
+	// The history continues from the restored state, so the
+	// next state is encoded against a new keyframe.
+	Buffer->NeedKeyframe = true;
+	MarkAllPagesDirty(Machine);
+
+	// States not encoded yet are the most recent ones.
+	if (Buffer->StagingCount > 0) {
+		u32 Index = (Buffer->StagingFirst + Buffer->StagingCount - 1) % RewindStagingCount;
+		memcpy(State, &Buffer->Staging[Index], sizeof(machine_state));
+		Buffer->StagingCount -= 1;
+		return 0;
+	}
+
+	if (Buffer->EntryCount == 0) return -1;
+
+	rewind_entry Entry = GetEntry(Buffer, Buffer->EntryCount - 1);
+
+	if (Entry.Keyframe) {
+		memset(State, 0, sizeof(machine_state));
+		Decode(State, Buffer->Ring + Entry.Offset, Entry.Size);
+	}
+	else {
+		// Find the keyframe, which is always kept along with its deltas.
+		u32 K = Buffer->EntryCount - 1;
+		while (!GetEntry(Buffer, K).Keyframe) K -= 1;
+		rewind_entry& Key = GetEntry(Buffer, K);
+
+		if (Buffer->DecodedKeySerial != Key.Serial) {
+			memset(Buffer->DecodedKey, 0, sizeof(machine_state));
+			Decode(Buffer->DecodedKey, Buffer->Ring + Key.Offset, Key.Size);
+			Buffer->DecodedKeySerial = Key.Serial;
+		}
+
+		memcpy(State, Buffer->DecodedKey, sizeof(machine_state));
+		Decode(State, Buffer->Ring + Entry.Offset, Entry.Size);
+	}
+
+	Buffer->EntryCount -= 1;
+	Buffer->ByteCount -= Entry.Size;
+	Buffer->WriteOffset = Entry.Offset;
+
+	return 0;
+}
+
+// Waits until all pushed states have been encoded.
+void FlushRewindBuffer(rewind_buffer* Buffer)
+{
+	std::unique_lock<std::mutex> Lock(Buffer->Mutex);
+	Buffer->Idle.wait(Lock, [Buffer] { return Buffer->StagingCount == 0 && !Buffer->Busy; });
+}
+
+void GetRewindStats(rewind_buffer* Buffer, rewind_stats& Stats)
+{
+	std::lock_guard<std::mutex> Lock(Buffer->Mutex);
+
+	Stats.FrameCount = Buffer->EntryCount + Buffer->StagingCount;
+	Stats.ByteCount = Buffer->ByteCount;
+	Stats.KeyframeCount = 0;
+	for (u32 I = 0; I < Buffer->EntryCount; I++)
+		if (GetEntry(Buffer, I).Keyframe)
+			Stats.KeyframeCount += 1;
+}
@@ -0,0 +1,185 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "nes.h"
+
+// ROM images are mapped read-only from the file where possible, so that
+// machines running the same game (in this process or others) share a single
+// copy of the PRG and CHR ROM data.  If mapping fails, the file is read into
+// memory instead.
+
+struct ines_header
+{
+	u8 Magic[4];
+	u8 NumPRG;
+	u8 NumCHR;
+	u8 Flags6;
+	u8 Flags7;
+	u8 NumRAM;
+	u8 Unused[7];
+};
+
+#ifdef _WIN32
+
+static void* MapFile(const char* Path, u64& Size)
+{
+	HANDLE File = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (File == INVALID_HANDLE_VALUE) return nullptr;
+
+	LARGE_INTEGER FileSize;
+	HANDLE Mapping = nullptr;
+	if (GetFileSizeEx(File, &FileSize) && FileSize.QuadPart > 0)
+		Mapping = CreateFileMappingA(File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(File);
+	if (!Mapping) return nullptr;
+
+	void* Data = MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(Mapping);
+	if (!Data) return nullptr;
+
+	Size = u64(FileSize.QuadPart);
+	return Data;
+}
+
+static void UnmapFile(void* Data, u64 Size)
+{
+	UnmapViewOfFile(Data);
+}
+
+#else
+
+static void* MapFile(const char* Path, u64& Size)
+{
+	int File = open(Path, O_RDONLY);
+	if (File < 0) return nullptr;
+
+	struct stat Stat;
+	void* Data = MAP_FAILED;
+	if (fstat(File, &Stat) == 0 && Stat.st_size > 0)
+		Data = mmap(nullptr, size_t(Stat.st_size), PROT_READ, MAP_PRIVATE, File, 0);
+	close(File);
+	if (Data == MAP_FAILED) return nullptr;
+
+	Size = u64(Stat.st_size);
+	return Data;
+}
+
+static void UnmapFile(void* Data, u64 Size)
+{
+	munmap(Data, size_t(Size));
+}
+
+#endif
+
+static void* ReadFile(const char* Path, u64& Size)
+{
+	FILE* File = fopen(Path, "rb");
+	if (!File) return nullptr;
+
+	fseek(File, 0, SEEK_END);
+	long FileSize = ftell(File);
+	fseek(File, 0, SEEK_SET);
+
+	void* Data = FileSize > 0 ? malloc(size_t(FileSize)) : nullptr;
+	if (!Data || fread(Data, 1, size_t(FileSize), File) < size_t(FileSize)) {
+		free(Data);
+		fclose(File);
+		return nullptr;
+	}
+
+	fclose(File);
+	Size = u64(FileSize);
+	return Data;
+}
+
+static void FreeROM(rom* ROM)
+{
+	if (ROM->IsMapped)
+		UnmapFile(ROM->Data, ROM->DataSize);
+	else
+		free(ROM->Data);
+	free(ROM);
+}
+
+// Opens an INES ROM image, with a reference count of one.
+// Returns null if the file can not be read, or is not a valid image.
+rom* OpenROM(const char* Path)
+{
+	rom* ROM = (rom*)calloc(1, sizeof(rom));
+	ROM->RefCount = 1;
+
+	ROM->Data = MapFile(Path, ROM->DataSize);
+	ROM->IsMapped = ROM->Data != nullptr;
+	if (!ROM->Data) ROM->Data = ReadFile(Path, ROM->DataSize);
+	if (!ROM->Data) {
+		free(ROM);
+		return nullptr;
+	}
+
+	const u8* Data = (const u8*)ROM->Data;
+
+	// Read header.
+	ines_header Header;
+	if (ROM->DataSize < sizeof(ines_header)) {
+		FreeROM(ROM);
+		return nullptr;
+	}
+	memcpy(&Header, Data, sizeof(ines_header));
+
+	// Verify header magic.
+	const u8 INESMagic[4] = { 'N', 'E', 'S', 0x1A };
+	if (memcmp(Header.Magic, INESMagic, 4) != 0) {
+		FreeROM(ROM);
+		return nullptr;
+	}
+
+	ROM->MapperID   = (Header.Flags6 >> 4) | (Header.Flags7 & 0xF0);
+	ROM->MirrorMode = (Header.Flags6 & 0x01) | ((Header.Flags7 >> 2) & 0x02);
+
+	ROM->PRGROMSize = Header.NumPRG * 16384;
+	ROM->PRGROM     = Data + sizeof(ines_header);
+	ROM->CHRROMSize = Header.NumCHR * 8192;
+	ROM->CHRROM     = ROM->PRGROM + ROM->PRGROMSize;
+
+	if (ROM->DataSize < sizeof(ines_header) + ROM->PRGROMSize + ROM->CHRROMSize) {
+		FreeROM(ROM);
+		return nullptr;
+	}
+
+	// Hash the ROM data (FNV-1a) to identify the cartridge in save states.
+	u64 Hash = 0xCBF29CE484222325;
+	for (u32 I = 0; I < ROM->PRGROMSize; I++)
+		Hash = (Hash ^ ROM->PRGROM[I]) * 0x100000001B3;
+	for (u32 I = 0; I < ROM->CHRROMSize; I++)
+		Hash = (Hash ^ ROM->CHRROM[I]) * 0x100000001B3;
+	ROM->Hash = Hash;
+
+	return ROM;
+}
+
+rom* RetainROM(rom* ROM)
+{
+	std::atomic_ref<u32>(ROM->RefCount).fetch_add(1, std::memory_order_relaxed);
+	return ROM;
+}
+
+// Drops a reference, and frees the image when the last one is gone.
+void ReleaseROM(rom* ROM)
+{
+	if (!ROM) return;
+	if (std::atomic_ref<u32>(ROM->RefCount).fetch_sub(1, std::memory_order_acq_rel) == 1)
+		FreeROM(ROM);
+}
@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "nes.h"
+
+// RAM search finds the addresses of game variables (lives, score, position)
+// by elimination.  Snapshots of RAM (and optionally PRG RAM) are taken every
+// frame into a ring buffer, and the set of candidate addresses is narrowed
+// down by comparing values between snapshots, or to constants.
+//
+// Each snapshot is stored contiguously, and candidates are kept as a byte
+// mask over the snapshot (0xFF for candidates, 0 otherwise).  A filter is
+// then a pass over whole snapshots with a fixed comparison, which compiles
+// into vector instructions, and filtering over a long history is one pass
+// per snapshot with the mask staying in the cache.
+//
+// Snapshots are identified by their age: snapshot 0 is the most recent one.
+// Addresses are CPU addresses: $0000-$07FF for RAM, $6000-$7FFF for PRG RAM.
+
+struct ram_search
+{
+	u32             Size;                       // Bytes per snapshot.
+	u32             MaxSnapshotCount;           // Capacity of the ring buffer.
+	u32             SnapshotCount;              // Snapshots in the ring buffer.
+	u32             Head;                       // Slot of the next snapshot.
+	u8*             Snapshots;                  // Ring buffer of snapshots.
+	u8*             Candidates;                 // Candidate mask (Size bytes).
+};
+
+static const u32 RAMSize = sizeof(machine_state::RAM);
+static const u32 PRGRAMSize = sizeof(machine_state::PRGRAM);
+
+static const u8* GetSnapshot(const ram_search* Search, u32 Snapshot)
+{
+	u32 Slot = (Search->Head + Search->MaxSnapshotCount - 1 - Snapshot) % Search->MaxSnapshotCount;
+	return Search->Snapshots + u64(Slot) * Search->Size;
+}
+
+static i32 GetOffset(const ram_search* Search, u16 Address)
+{
+	if (Address < RAMSize) return Address;
+	if (Search->Size > RAMSize && Address >= 0x6000) return RAMSize + (Address - 0x6000);
+	return -1;
+}
+
+static u16 GetAddress(u32 Offset)
+{
+	return Offset < RAMSize ? u16(Offset) : u16(0x6000 + Offset - RAMSize);
+}
+
+template <ram_search_compare Compare>
+inline bool Test(u8 A, u8 B)
+{
+	if constexpr (Compare == RAMSearchEqual)          return A == B;
+	if constexpr (Compare == RAMSearchNotEqual)       return A != B;
+	if constexpr (Compare == RAMSearchLess)           return A < B;
+	if constexpr (Compare == RAMSearchLessOrEqual)    return A <= B;
+	if constexpr (Compare == RAMSearchGreater)        return A > B;
+	if constexpr (Compare == RAMSearchGreaterOrEqual) return A >= B;
+}
+
+// Snapshots are processed in blocks of a fixed size, so that the inner
+// loops have a constant trip count and are vectorized without a remainder.
+static const u32 BlockSize = 64;
+
+static_assert(sizeof(machine_state::RAM) % BlockSize == 0);
+static_assert(sizeof(machine_state::PRGRAM) % BlockSize == 0);
+
+// Keeps the candidates where New compares to Old + Value, or to
+// Value if Old is null.
+template <ram_search_compare Compare>
+static void Filter(u8* Candidates, const u8* New, const u8* Old, u8 Value, u32 Size)
+{
+	for (u32 Block = 0; Block < Size; Block += BlockSize) {
+		u8* C = Candidates + Block;
+		const u8* N = New + Block;
+		if (Old) {
+			const u8* O = Old + Block;
+			for (u32 I = 0; I < BlockSize; I++)
+				C[I] &= -u8(Test<Compare>(N[I], u8(O[I] + Value)));
+		}
+		else {
+			for (u32 I = 0; I < BlockSize; I++)
+				C[I] &= -u8(Test<Compare>(N[I], Value));
+		}
+	}
+}
+
+static void Filter(ram_search* Search, ram_search_compare Compare, const u8* New, const u8* Old, u8 Value)
+{
+	u8* Candidates = Search->Candidates;
+	u32 Size = Search->Size;
+
+	switch (Compare) {
+		case RAMSearchEqual:          Filter<RAMSearchEqual>         (Candidates, New, Old, Value, Size); break;
+		case RAMSearchNotEqual:       Filter<RAMSearchNotEqual>      (Candidates, New, Old, Value, Size); break;
+		case RAMSearchLess:           Filter<RAMSearchLess>          (Candidates, New, Old, Value, Size); break;
+		case RAMSearchLessOrEqual:    Filter<RAMSearchLessOrEqual>   (Candidates, New, Old, Value, Size); break;
+		case RAMSearchGreater:        Filter<RAMSearchGreater>       (Candidates, New, Old, Value, Size); break;
+		case RAMSearchGreaterOrEqual: Filter<RAMSearchGreaterOrEqual>(Candidates, New, Old, Value, Size); break;
+	}
+}
+
+static u32 CountCandidates(const ram_search* Search)
+{
+	u32 Count = 0;
+	for (u32 Block = 0; Block < Search->Size; Block += BlockSize) {
+		const u8* C = Search->Candidates + Block;
+		u8 BlockCount = 0;
+		for (u32 I = 0; I < BlockSize; I++)
+			BlockCount += C[I] & 1;
+		Count += BlockCount;
+	}
+	return Count;
+}
+
+// Creates a search keeping up to MaxSnapshotCount snapshots
+// (each 2K, or 10K with PRG RAM included).
+ram_search* CreateRAMSearch(u32 MaxSnapshotCount, bool IncludePRGRAM)
+{
+	if (MaxSnapshotCount == 0) MaxSnapshotCount = 1;
+
+	ram_search* Search = (ram_search*)calloc(1, sizeof(ram_search));
+	Search->Size = RAMSize + (IncludePRGRAM ? PRGRAMSize : 0);
+	Search->MaxSnapshotCount = MaxSnapshotCount;
+	Search->Snapshots = (u8*)malloc(u64(MaxSnapshotCount) * Search->Size);
+	Search->Candidates = (u8*)malloc(Search->Size);
+	ResetRAMSearch(Search);
+	return Search;
+}
+
+void DestroyRAMSearch(ram_search* Search)
+{
+	if (!Search) return;
+	free(Search->Snapshots);
+	free(Search->Candidates);
+	free(Search);
+}
+
+// Makes every address a candidate again.  The snapshots are kept, so that
+// a new search can be made over the same history.
+void ResetRAMSearch(ram_search* Search)
+{
+	memset(Search->Candidates, 0xFF, Search->Size);
+}
+
+void ClearRAMSnapshots(ram_search* Search)
+{
+	Search->SnapshotCount = 0;
+	Search->Head = 0;
+}
+
+// Takes a snapshot of the memory of the machine.  When the ring buffer
+// is full, the oldest snapshot is dropped.
+void AddRAMSnapshot(ram_search* Search, const machine& Machine)
+{
+	u8* Snapshot = Search->Snapshots + u64(Search->Head) * Search->Size;
+	memcpy(Snapshot, Machine.RAM, RAMSize);
+	if (Search->Size > RAMSize)
+		memcpy(Snapshot + RAMSize, Machine.PRGRAM, PRGRAMSize);
+
+	Search->Head = (Search->Head + 1) % Search->MaxSnapshotCount;
+	if (Search->SnapshotCount < Search->MaxSnapshotCount)
+		Search->SnapshotCount += 1;
+}
+
+u32 GetRAMSnapshotCount(const ram_search* Search)
+{
+	return Search->SnapshotCount;
+}
+
+// Returns the value at an address in a snapshot, or -1 if the snapshot
+// or the address is not in the search.
+i32 GetRAMSnapshotValue(const ram_search* Search, u32 Snapshot, u16 Address)
+{
+	i32 Offset = GetOffset(Search, Address);
+	if (Snapshot >= Search->SnapshotCount || Offset < 0) return -1;
+	return GetSnapshot(Search, Snapshot)[Offset];
+}
+
+// Keeps the candidates whose value in the snapshot compares to Value.
+// Returns the number of candidates left, or -1 if there is no such snapshot.
+i32 FilterRAMSearch(ram_search* Search, ram_search_compare Compare, u32 Snapshot, u8 Value)
+{
+	if (Snapshot >= Search->SnapshotCount) return -1;
+	Filter(Search, Compare, GetSnapshot(Search, Snapshot), nullptr, Value);
+	return i32(CountCandidates(Search));
+}
+
+// Keeps the candidates whose value in the newer snapshot compares to the
+// value in the older snapshot plus Value.  Returns the number of candidates
+// left, or -1 if there are no such snapshots.
+i32 FilterRAMSearch(ram_search* Search, ram_search_compare Compare, u32 Newer, u32 Older, u8 Value)
+{
+	if (Newer >= Search->SnapshotCount || Older >= Search->SnapshotCount) return -1;
+	Filter(Search, Compare, GetSnapshot(Search, Newer), GetSnapshot(Search, Older), Value);
+	return i32(CountCandidates(Search));
+}
+
+// Keeps the candidates for which the comparison holds between every pair
+// of consecutive snapshots among the Count most recent ones, e.g. "equal,
+// plus 1" for a frame counter, or "equal" for a value that never changed.
+// Returns the number of candidates left, or -1 if there are fewer snapshots.
+i32 FilterRAMSearchHistory(ram_search* Search, ram_search_compare Compare, u32 Count, u8 Value)
+{
+	if (Count > Search->SnapshotCount) return -1;
+	for (u32 I = 1; I < Count; I++)
+		Filter(Search, Compare, GetSnapshot(Search, I - 1), GetSnapshot(Search, I), Value);
+	return i32(CountCandidates(Search));
+}
+
+// Copies up to MaxCount candidate addresses (in increasing order), and
+// returns the total number of candidates.
+u32 GetRAMSearchCandidates(const ram_search* Search, u16* Addresses, u32 MaxCount)
+{
+	u32 Count = 0;
+	for (u32 I = 0; I < Search->Size; I++) {
+		if (!Search->Candidates[I]) continue;
+		if (Count < MaxCount) Addresses[Count] = GetAddress(I);
+		Count += 1;
+	}
+	return Count;
+}
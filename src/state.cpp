@@ -0,0 +1,54 @@
+#include <string.h>
+
+#include "nes.h"
+
+// A save state is a header followed by a copy of the machine_state block.
+// Saving and loading are single copies into and out of a caller-provided
+// buffer, cheap enough to do every frame.  The states are only portable
+// between builds with identical structure layouts.
+
+u32 GetStateSize(const machine&)
+{
+	return sizeof(state_header) + sizeof(machine_state);
+}
+
+// Returns the state size in bytes, or -1 if the buffer is too small.
+i32 SaveState(machine& Machine, void* Buffer, u32 Size)
+{
+	u32 StateSize = GetStateSize(Machine);
+	if (!Machine.IsLoaded || Size < StateSize) return -1;
+
+	state_header Header;
+	memcpy(Header.Magic, StateMagic, sizeof(Header.Magic));
+	Header.Version = StateVersion;
+	Header.Size = StateSize;
+	Header.ROMHash = Machine.ROMHash;
+
+	u8* P = (u8*)Buffer;
+	memcpy(P, &Header, sizeof(Header));
+	memcpy(P + sizeof(Header), (machine_state*)&Machine, sizeof(machine_state));
+
+	return i32(StateSize);
+}
+
+// Returns 0 on success, or -1 if the state does not
+// belong to the loaded ROM or is in an unsupported format.
+i32 LoadState(machine& Machine, const void* Buffer, u32 Size)
+{
+	if (!Machine.IsLoaded || Size < sizeof(state_header)) return -1;
+
+	const u8* P = (const u8*)Buffer;
+
+	state_header Header;
+	memcpy(&Header, P, sizeof(Header));
+
+	if (memcmp(Header.Magic, StateMagic, sizeof(Header.Magic)) != 0) return -1;
+	if (Header.Version != StateVersion) return -1;
+	if (Header.ROMHash != Machine.ROMHash) return -1;
+	if (Header.Size != GetStateSize(Machine) || Header.Size > Size) return -1;
+
+	memcpy((machine_state*)&Machine, P + sizeof(Header), sizeof(machine_state));
+	MarkAllPagesDirty(Machine);
+
+	return 0;
+}
@@ -0,0 +1,180 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "nes.h"
+
+// Instruction trace records are written by the CPU core into a ring buffer
+// holding the most recent records.  If a trace file is open, a background
+// thread streams the records into the file as they are produced.  Use the
+// tracefmt tool to convert a trace file into text.
+
+struct trace_writer
+{
+	std::thread         Thread;
+	std::atomic<bool>   Exit;
+	std::atomic<u64>    Written;                // Number of records saved to the file.
+};
+
+static void RunTraceWriter(machine* Machine)
+{
+	trace_writer* Writer = Machine->TraceWriter;
+	u64 Mask = Machine->TraceBufferSize - 1;
+	u64 Written = 0;
+
+	for (;;) {
+		// Check for exit before draining, so that the last records are not lost.
+		bool Exit = Writer->Exit.load(std::memory_order_acquire);
+
+		u64 Line = std::atomic_ref<u64>(Machine->TraceLine).load(std::memory_order_acquire);
+
+		while (Written < Line) {
+			// Write out the contiguous part of the ring buffer.
+			u64 Index = Written & Mask;
+			u64 Count = Line - Written;
+			if (Count > Machine->TraceBufferSize - Index)
+				Count = Machine->TraceBufferSize - Index;
+
+			fwrite(&Machine->TraceBuffer[Index], sizeof(trace_record), Count, Machine->TraceFile);
+
+			Written += Count;
+			Writer->Written.store(Written, std::memory_order_release);
+		}
+
+		if (Exit) break;
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	fflush(Machine->TraceFile);
+}
+
+i32 OpenTrace(machine& Machine, const char* Path, u32 BufferSize)
+{
+	CloseTrace(Machine);
+
+	// Round the buffer size up to a power of two.
+	u32 Size = 1;
+	while (Size < BufferSize) Size <<= 1;
+
+	Machine.TraceBuffer = (trace_record*)calloc(Size, sizeof(trace_record));
+	Machine.TraceBufferSize = Size;
+	Machine.TraceLine = 0;
+
+	if (Path) {
+		Machine.TraceFile = fopen(Path, "wb");
+		if (!Machine.TraceFile) {
+			CloseTrace(Machine);
+			return -1;
+		}
+
+		trace_file_header Header = {};
+		memcpy(Header.Magic, TraceFileMagic, sizeof(Header.Magic));
+		Header.Version = TraceFileVersion;
+		Header.RecordSize = sizeof(trace_record);
+		fwrite(&Header, sizeof(Header), 1, Machine.TraceFile);
+
+		Machine.TraceWriter = new trace_writer();
+		Machine.TraceWriter->Thread = std::thread(RunTraceWriter, &Machine);
+	}
+
+	Machine.TraceEnable = true;
+	SelectRunLoop(Machine);
+
+	return 0;
+}
+
+void CloseTrace(machine& Machine)
+{
+	if (Machine.TraceWriter) {
+		Machine.TraceWriter->Exit.store(true, std::memory_order_release);
+		Machine.TraceWriter->Thread.join();
+		delete Machine.TraceWriter;
+		Machine.TraceWriter = nullptr;
+	}
+
+	if (Machine.TraceFile) fclose(Machine.TraceFile);
+	free(Machine.TraceBuffer);
+
+	Machine.TraceFile = nullptr;
+	Machine.TraceBuffer = nullptr;
+	Machine.TraceBufferSize = 0;
+	Machine.TraceLine = 0;
+	Machine.TraceEnable = false;
+
+	SelectRunLoop(Machine);
+}
+
+void WriteTraceRecord(machine& Machine, const trace_record& Record)
+{
+	u64 Line = Machine.TraceLine;
+
+	// When streaming to a file, wait for the writer thread
+	// instead of overwriting records it has not saved yet.
+	if (Machine.TraceWriter) {
+		while (Line - Machine.TraceWriter->Written.load(std::memory_order_acquire) >= Machine.TraceBufferSize)
+			std::this_thread::yield();
+	}
+
+	Machine.TraceBuffer[Line & (Machine.TraceBufferSize - 1)] = Record;
+
+	std::atomic_ref<u64>(Machine.TraceLine).store(Line + 1, std::memory_order_release);
+}
+
+u32 DumpTrace(machine& Machine, FILE* File, u32 Count)
+{
+	if (!Machine.TraceBuffer) return 0;
+
+	// Only the most recent records are still in the ring buffer.
+	if (Count > Machine.TraceBufferSize) Count = Machine.TraceBufferSize;
+	if (Count > Machine.TraceLine) Count = u32(Machine.TraceLine);
+
+	char Line[128];
+	for (u64 I = Machine.TraceLine - Count; I < Machine.TraceLine; I++) {
+		const trace_record& Record = Machine.TraceBuffer[I & (Machine.TraceBufferSize - 1)];
+		FormatTraceRecord(Line, sizeof(Line), Record, true);
+		fputs(Line, File);
+	}
+
+	return Count;
+}
+
+// Initializes a filter that passes every trace record.
+void InitTraceFilter(trace_filter& Filter)
+{
+	memset(&Filter, 0, sizeof(trace_filter));
+
+	Filter.Flags = TraceFilterInterrupts;
+	Filter.PRGBanks = ~0ull;
+	SetTraceFilterRange(Filter.Opcode, 0x00, 0xFF, true);
+	SetTraceFilterRange(Filter.PC, 0x0000, 0xFFFF, true);
+}
+
+void SetTraceFilterRange(u64* Bitmap, u32 First, u32 Last, bool Value)
+{
+	for (u32 I = First; I <= Last; I++) {
+		if (Value)
+			Bitmap[I >> 6] |= 1ull << (I & 63);
+		else
+			Bitmap[I >> 6] &= ~(1ull << (I & 63));
+	}
+}
+
+// Installs a copy of the filter, or removes the filter if null.
+void SetTraceFilter(machine& Machine, const trace_filter* Filter)
+{
+	if (!Filter) {
+		free(Machine.TraceFilter);
+		Machine.TraceFilter = nullptr;
+		return;
+	}
+
+	if (!Machine.TraceFilter)
+		Machine.TraceFilter = (trace_filter*)malloc(sizeof(trace_filter));
+
+	memcpy(Machine.TraceFilter, Filter, sizeof(trace_filter));
+}
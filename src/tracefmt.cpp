@@ -0,0 +1,71 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nes.h"
+
+// Converts a binary instruction trace (see trace.cpp) into text.
+
+int main(int argc, char* args[])
+{
+	const char* Path = nullptr;
+	bool Timing = false;
+	u64 Last = 0;
+
+	for (i32 I = 1; I < argc; I++) {
+		if (!strcmp(args[I], "--timing"))
+			Timing = true;
+		else if (!strcmp(args[I], "--last") && I + 1 < argc)
+			Last = strtoull(args[++I], nullptr, 10);
+		else
+			Path = args[I];
+	}
+
+	if (!Path) {
+		printf("usage: tracefmt [--timing] [--last N] <trace.bin>\n");
+		return -1;
+	}
+
+	FILE* File = fopen(Path, "rb");
+	if (!File) {
+		fprintf(stderr, "Failed to open %s\n", Path);
+		return -1;
+	}
+
+	trace_file_header Header;
+	if (fread(&Header, sizeof(Header), 1, File) < 1
+	||  memcmp(Header.Magic, TraceFileMagic, sizeof(Header.Magic)) != 0
+	||  Header.Version != TraceFileVersion
+	||  Header.RecordSize != sizeof(trace_record)) {
+		fprintf(stderr, "%s is not a supported trace file\n", Path);
+		fclose(File);
+		return -1;
+	}
+
+	// Skip to the last N records.
+	if (Last > 0) {
+		fseek(File, 0, SEEK_END);
+		u64 Count = (ftell(File) - sizeof(Header)) / sizeof(trace_record);
+		if (Count > Last)
+			fseek(File, long(sizeof(Header) + (Count - Last) * sizeof(trace_record)), SEEK_SET);
+		else
+			fseek(File, sizeof(Header), SEEK_SET);
+	}
+
+	trace_record Records[4096];
+	char Line[128];
+
+	for (;;) {
+		size_t Count = fread(Records, sizeof(trace_record), 4096, File);
+		if (Count == 0) break;
+
+		for (size_t I = 0; I < Count; I++) {
+			FormatTraceRecord(Line, sizeof(Line), Records[I], Timing);
+			fputs(Line, stdout);
+		}
+	}
+
+	fclose(File);
+	return 0;
+}